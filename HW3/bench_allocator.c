@@ -0,0 +1,383 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "customAllocator.h"
+
+/*=============================================================================
+* Classic allocator benchmarks against customMTMalloc and glibc malloc:
+*
+*   bench_allocator [-t max_threads] [-d seconds] [-b benchmark] [-a allocator]
+*
+* Every benchmark runs at 1, 2, 4, ... up to max_threads (default: online
+* CPUs) threads, each run in a child process of its own so the maximum RSS
+* reported is that run's alone.
+*
+*   larson        server simulation: threads replace random blocks of a
+*                 working set, then hand it to a new thread that frees them
+*   threadtest    each thread allocates and frees batches of small blocks
+*   xmalloc       blocks are allocated on one thread and freed on the next
+*   cache-scratch each thread writes a small block of its own over and over,
+*                 starting with one allocated next to the others' blocks
+=============================================================================*/
+
+typedef struct
+{
+    const char* name;
+    void (*init)(void);
+    void (*fini)(void);
+    void* (*alloc)(size_t size);
+    void (*release)(void* ptr);
+} Allocator;
+
+static void glibc_none(void) {}
+static void* glibc_alloc(size_t size) { return malloc(size); }
+static void glibc_release(void* ptr) { free(ptr); }
+
+static const Allocator allocators[] = {
+    { "custom", heapCreate, heapKill, customMTMalloc, customMTFree },
+    { "glibc", glibc_none, glibc_none, glibc_alloc, glibc_release },
+};
+#define NUM_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+static const Allocator* A;         // Allocator of this run
+static int num_threads;            // Threads of this run
+static double duration = 1.0;      // Seconds per timed run
+static bool stop = false;          // Tells timed runs to finish
+static size_t total_ops = 0;       // Allocations and frees done by the run
+
+static uint32_t next_rand(uint32_t* seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+static void sleep_sec(double sec) {
+    struct timespec ts = { (time_t)sec, (long)((sec - (double)(time_t)sec) * 1e9) };
+    nanosleep(&ts, NULL);
+}
+static bool stopping(void) {
+    return __atomic_load_n(&stop, __ATOMIC_RELAXED);
+}
+static void stop_after(double sec) {
+    sleep_sec(sec);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+}
+static void add_ops(size_t ops) {
+    __atomic_add_fetch(&total_ops, ops, __ATOMIC_RELAXED);
+}
+static void run_threads(void* (*func)(void*), void* args, size_t arg_size) {
+    pthread_t* threads = (pthread_t*)malloc((size_t)num_threads * sizeof(pthread_t));
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, func, (char*)args + (size_t)i * arg_size);
+    }
+    for (int i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+/*=============================================================================
+* larson
+=============================================================================*/
+#define LARSON_SLOTS 1000
+#define LARSON_MIN 10
+#define LARSON_MAX 500
+#define LARSON_ROUNDS 10000        // Replacements before handing the set on
+
+typedef struct
+{
+    void* slots[LARSON_SLOTS];
+    uint32_t seed;
+    pthread_t thread;              // Thread that has the set
+    bool joinable;                 // Its predecessor, to be joined
+} LarsonSet;
+
+static int larson_running = 0;     // Sets still handed on
+
+static void* larson_func(void* arg) {
+    LarsonSet* set = (LarsonSet*)arg;
+    if (set->joinable) pthread_join(set->thread, NULL);
+    set->thread = pthread_self();
+    set->joinable = false;
+    for (int round = 0; round < LARSON_ROUNDS; round++) {
+        uint32_t r = next_rand(&set->seed);
+        size_t slot = r % LARSON_SLOTS;
+        A->release(set->slots[slot]);
+        set->slots[slot] = A->alloc(LARSON_MIN + (r >> 16) % (LARSON_MAX - LARSON_MIN));
+    }
+    add_ops(2 * LARSON_ROUNDS);
+    // hand the blocks to a new thread, as a server does with connections;
+    // that one joins this one, and the main thread joins the last
+    set->joinable = true;
+    pthread_t next;
+    if (stopping() || pthread_create(&next, NULL, larson_func, set) != 0) {
+        __atomic_sub_fetch(&larson_running, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+static void bench_larson(void) {
+    LarsonSet* sets = (LarsonSet*)malloc((size_t)num_threads * sizeof(LarsonSet));
+    for (int i = 0; i < num_threads; i++) {
+        sets[i].seed = (uint32_t)i * 7919 + 1;
+        for (int s = 0; s < LARSON_SLOTS; s++) {
+            sets[i].slots[s] = A->alloc(LARSON_MIN + next_rand(&sets[i].seed) % (LARSON_MAX - LARSON_MIN));
+        }
+    }
+    larson_running = num_threads;
+    for (int i = 0; i < num_threads; i++) {
+        sets[i].joinable = false;
+        pthread_t t;
+        if (pthread_create(&t, NULL, larson_func, &sets[i]) != 0) {
+            __atomic_sub_fetch(&larson_running, 1, __ATOMIC_RELEASE);
+        }
+    }
+    stop_after(duration);
+    while (__atomic_load_n(&larson_running, __ATOMIC_ACQUIRE) > 0) sched_yield();
+    for (int i = 0; i < num_threads; i++) {
+        if (sets[i].joinable) pthread_join(sets[i].thread, NULL);
+        for (int s = 0; s < LARSON_SLOTS; s++) A->release(sets[i].slots[s]);
+    }
+    free(sets);
+}
+
+/*=============================================================================
+* threadtest
+=============================================================================*/
+#define THREADTEST_ITERATIONS 50
+#define THREADTEST_OBJECTS 100000  // Split between the threads
+#define THREADTEST_SIZE 64
+
+static void* threadtest_func(void* arg) {
+    (void)arg;
+    int objects = THREADTEST_OBJECTS / num_threads;
+    void** blocks = (void**)malloc((size_t)objects * sizeof(void*));
+    for (int it = 0; it < THREADTEST_ITERATIONS; it++) {
+        for (int i = 0; i < objects; i++) {
+            blocks[i] = A->alloc(THREADTEST_SIZE);
+            *(volatile char*)blocks[i] = 1;
+        }
+        for (int i = 0; i < objects; i++) A->release(blocks[i]);
+    }
+    free(blocks);
+    add_ops(2 * (size_t)THREADTEST_ITERATIONS * (size_t)objects);
+    return NULL;
+}
+static void bench_threadtest(void) {
+    run_threads(threadtest_func, NULL, 0);
+}
+
+/*=============================================================================
+* xmalloc: thread i allocates batches that thread i + 1 frees
+=============================================================================*/
+#define XMALLOC_BATCH 256
+#define XMALLOC_MAX_SIZE 512
+#define XMALLOC_BACKLOG 64         // Batches queued for a thread before its producer waits
+
+typedef struct XBatch
+{
+    void* blocks[XMALLOC_BATCH];
+    struct XBatch* next;
+} XBatch;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    XBatch* queue;                 // Batches for this thread to free
+    int queued;
+    int index;
+} XMailbox;
+
+static XMailbox* mailboxes;
+
+static void xmalloc_drain(XMailbox* box) {
+    pthread_mutex_lock(&box->lock);
+    XBatch* batch = box->queue;
+    box->queue = NULL;
+    __atomic_store_n(&box->queued, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&box->lock);
+    size_t ops = 0;
+    while (batch) {
+        XBatch* next = batch->next;
+        for (int i = 0; i < XMALLOC_BATCH; i++) A->release(batch->blocks[i]);
+        free(batch);
+        batch = next;
+        ops += XMALLOC_BATCH;
+    }
+    add_ops(ops);
+}
+static void* xmalloc_func(void* arg) {
+    XMailbox* own = (XMailbox*)arg;
+    XMailbox* next = &mailboxes[(own->index + 1) % num_threads];
+    uint32_t seed = (uint32_t)own->index * 7919 + 1;
+    while (!stopping()) {
+        if (__atomic_load_n(&next->queued, __ATOMIC_RELAXED) < XMALLOC_BACKLOG) {
+            XBatch* batch = (XBatch*)malloc(sizeof(XBatch));
+            for (int i = 0; i < XMALLOC_BATCH; i++) {
+                batch->blocks[i] = A->alloc(8 + next_rand(&seed) % XMALLOC_MAX_SIZE);
+            }
+            add_ops(XMALLOC_BATCH);
+            pthread_mutex_lock(&next->lock);
+            batch->next = next->queue;
+            next->queue = batch;
+            __atomic_store_n(&next->queued, next->queued + 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&next->lock);
+        } else {
+            sched_yield();
+        }
+        xmalloc_drain(own);
+    }
+    return NULL;
+}
+static void* xmalloc_timer(void* arg) {
+    (void)arg;
+    stop_after(duration);
+    return NULL;
+}
+static void bench_xmalloc(void) {
+    mailboxes = (XMailbox*)calloc((size_t)num_threads, sizeof(XMailbox));
+    for (int i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&mailboxes[i].lock, NULL);
+        mailboxes[i].index = i;
+    }
+    pthread_t timer;
+    pthread_create(&timer, NULL, xmalloc_timer, NULL);
+    run_threads(xmalloc_func, mailboxes, sizeof(XMailbox));
+    pthread_join(timer, NULL);
+    for (int i = 0; i < num_threads; i++) {
+        xmalloc_drain(&mailboxes[i]);
+        pthread_mutex_destroy(&mailboxes[i].lock);
+    }
+    free(mailboxes);
+}
+
+/*=============================================================================
+* cache-scratch
+=============================================================================*/
+#define SCRATCH_ITERATIONS 20000   // Split between the threads
+#define SCRATCH_SIZE 8
+#define SCRATCH_WRITES 500
+
+static void* scratch_func(void* arg) {
+    char* block = *(char**)arg;
+    int iterations = SCRATCH_ITERATIONS / num_threads;
+    // the first block was allocated by the main thread, likely on the same
+    // cache line as the other threads' ones
+    A->release(block);
+    for (int it = 0; it < iterations; it++) {
+        volatile char* b = (volatile char*)A->alloc(SCRATCH_SIZE);
+        for (int w = 0; w < SCRATCH_WRITES; w++) {
+            for (int i = 0; i < SCRATCH_SIZE; i++) b[i] = (char)(b[i] + 1);
+        }
+        A->release((void*)b);
+    }
+    add_ops(2 * (size_t)iterations + 1);
+    return NULL;
+}
+static void bench_cache_scratch(void) {
+    char** blocks = (char**)malloc((size_t)num_threads * sizeof(char*));
+    for (int i = 0; i < num_threads; i++) blocks[i] = (char*)A->alloc(SCRATCH_SIZE);
+    add_ops((size_t)num_threads);
+    run_threads(scratch_func, blocks, sizeof(char*));
+    free(blocks);
+}
+
+/*=============================================================================
+* Driver
+=============================================================================*/
+typedef struct
+{
+    const char* name;
+    void (*run)(void);
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+    { "larson", bench_larson },
+    { "threadtest", bench_threadtest },
+    { "xmalloc", bench_xmalloc },
+    { "cache-scratch", bench_cache_scratch },
+};
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+// Runs one benchmark in a child process; returns its ops/s, or a negative
+// value if the child failed. *rss_kb gets the child's maximum RSS.
+static double run_child(const Benchmark* bench, long* rss_kb) {
+    int fds[2];
+    if (pipe(fds) != 0) return -1;
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        close(fds[0]);
+        A->init();
+        double start = now_sec();
+        bench->run();
+        double rate = (double)total_ops / (now_sec() - start);
+        A->fini();
+        _exit(write(fds[1], &rate, sizeof(rate)) == sizeof(rate) ? 0 : 1);
+    }
+    close(fds[1]);
+    double rate = -1;
+    if (read(fds[0], &rate, sizeof(rate)) != sizeof(rate)) rate = -1;
+    close(fds[0]);
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+    *rss_kb = ru.ru_maxrss;
+    return rate;
+}
+
+int main(int argc, char** argv) {
+    int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char* only_bench = NULL;
+    const char* only_alloc = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            max_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            duration = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            only_bench = argv[++i];
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            only_alloc = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [-t max_threads] [-d seconds] [-b benchmark] [-a custom|glibc]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (max_threads < 1) max_threads = 1;
+    if (duration <= 0) duration = 1.0;
+
+    printf("%-14s %-9s %7s %14s %12s\n", "benchmark", "allocator", "threads", "ops/s", "max RSS KiB");
+    fflush(stdout);
+    for (size_t b = 0; b < NUM_BENCHMARKS; b++) {
+        if (only_bench && strcmp(only_bench, benchmarks[b].name) != 0) continue;
+        for (int t = 1; t <= max_threads; t = t * 2 > max_threads && t < max_threads ? max_threads : t * 2) {
+            for (size_t a = 0; a < NUM_ALLOCATORS; a++) {
+                if (only_alloc && strcmp(only_alloc, allocators[a].name) != 0) continue;
+                A = &allocators[a];
+                num_threads = t;
+                long rss_kb = 0;
+                double rate = run_child(&benchmarks[b], &rss_kb);
+                if (rate < 0) {
+                    printf("%-14s %-9s %7d %14s\n", benchmarks[b].name, A->name, t, "failed");
+                } else {
+                    printf("%-14s %-9s %7d %14.0f %12ld\n", benchmarks[b].name, A->name, t, rate, rss_kb);
+                }
+                fflush(stdout);
+            }
+        }
+    }
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include "customAllocator.h"
 #include <stdio.h>
@@ -7,6 +8,11 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <time.h>
 
 // Explicit declarations for sbrk and brk (needed for C99 standard)
 extern void *sbrk(intptr_t increment);
@@ -14,369 +20,1894 @@ extern int brk(void *addr);
 
 Block* blockList = NULL;
 static void* heap_start = NULL;
+static Block* heap_top = NULL;     // fence of the most recent heap segment
+static size_t list_pad = 0;        // alignment pad in front of blockList
+static size_t trim_threshold = DEFAULT_TRIM_THRESHOLD;
+static size_t mmap_threshold = DEFAULT_MMAP_THRESHOLD;
+static size_t page_size = 0;
+static Block* bins[NUM_BINS];
+static FreeTree* large_tree = NULL; // free blocks of SMALL_BIN_LIMIT bytes and more
+static uint64_t binmap[BINMAP_WORDS];
+static AllocStats heap_stats;      // counters kept by the Part A calls
 //helper function declaration:
 static void init_heap_start_if_needed(void);
-static size_t align4(size_t x);
+static size_t payload_for(size_t x);
+static size_t head_tag(void* b, uint32_t magic);
+static size_t block_size(Block* b);
+static bool block_is(Block* b, size_t flag);
+static void block_set_flag(Block* b, size_t flag, bool on);
+static void block_set_size(Block* b, size_t size);
+static void block_stamp(Block* b, size_t size, size_t flags);
 static void* block_to_payload(Block* b);
+static FreeLinks* links_of(Block* b);
+static Block* next_block(Block* b);
+static Block* prev_block(Block* b);
+static void mark_free(Block* b);
+static void mark_used(Block* b);
+static void set_fence(Block* b);
+static size_t tree_span(FreeTree* n);
+static bool tree_less(FreeTree* a, FreeTree* b);
+static uint64_t tree_priority(FreeTree* n);
+static void tree_split(FreeTree* t, FreeTree* key, FreeTree** l, FreeTree** r);
+static FreeTree* tree_merge(FreeTree* a, FreeTree* b);
+static void tree_insert(FreeTree** root, FreeTree* n);
+static void tree_remove(FreeTree** root, FreeTree* n);
+static FreeTree* tree_lower_bound(FreeTree* t, size_t span);
+static size_t bin_index(size_t size);
+static void bin_insert(Block* b);
+static void bin_remove(Block* b);
+static size_t next_nonempty_bin(size_t from);
 static Block* find_block_by_payload(void* payload);
 static Block* find_best_fit(size_t need);
 static void split_block_if_worth(Block* b, size_t need);
-static int are_adjacent(Block* a, Block* b);
-static Block* find_prev(Block* target);
+static Block* extend_heap(size_t need, size_t* dirty);
+static Block* heap_alloc_block(size_t need, size_t* dirty);
+static void* heap_malloc(size_t size, size_t* dirty);
+static bool grow_in_place(Block* b, size_t need);
+static Block* mmap_chunk_alloc(size_t need, size_t alignment, uint32_t magic);
+static Block* mmap_chunk_header(void* payload, uint32_t magic);
+static Block* mmap_chunk_lookup(void* payload, uint32_t magic);
+static void mmap_chunk_free(Block* b);
+static Block* mmap_chunk_resize(Block* b, size_t need, uint32_t magic);
+static size_t mmap_chunk_length(Block* b);
+static size_t stats_class(size_t size);
+static void heap_stats_count(Block* b, bool alloc);
+static void heap_stats_resized(Block* b, size_t old_size);
+static void prof_alloc(void* ptr, size_t size);
+static void prof_free(void* ptr);
+static bool trace_wanted(void);
+static uint32_t trace_begin(void* old);
+static void* trace_end(int op, uint32_t id, void* old, void* result, size_t size, size_t alignment);
 static void init_heap_start_if_needed(void) {
     if (!heap_start) {
         heap_start = sbrk(0);
     }
 }
-static size_t align4(size_t x) {
-    if (x == 0) return 0;
-    return (size_t)ALIGN_TO_MULT_OF_4(x);
+// Payload size for a request: header plus payload fill whole ALIGNMENT
+// units, so the next header keeps the next payload aligned.
+static size_t payload_for(size_t x) {
+    size_t size = (size_t)ALIGN_TO_MULT_OF_16(x + sizeof(Block)) - sizeof(Block);
+    return size < MIN_PAYLOAD ? MIN_PAYLOAD : size;
+}
+// The tag never is 0, so a cleared or fence word never passes as a header.
+static size_t head_tag(void* b, uint32_t magic) {
+    uint64_t h = ((uint64_t)(uintptr_t)b ^ magic) * 0x9E3779B97F4A7C15ull;
+    return (size_t)((h >> (BLOCK_TAG_SHIFT + 1)) | 0x8000) << BLOCK_TAG_SHIFT;
+}
+static size_t block_size(Block* b) {
+    return (b->head & BLOCK_SPAN_MASK) - sizeof(Block);
+}
+static bool block_is(Block* b, size_t flag) {
+    return (b->head & flag) != 0;
+}
+static void block_set_flag(Block* b, size_t flag, bool on) {
+    if (on) b->head |= flag;
+    else b->head &= ~flag;
+}
+static void block_set_size(Block* b, size_t size) {
+    b->head = (b->head & ~BLOCK_SPAN_MASK) | (size + sizeof(Block));
+}
+// Writes a complete header for a heap block at b.
+static void block_stamp(Block* b, size_t size, size_t flags) {
+    b->head = head_tag(b, BLOCK_MAGIC) | (size + sizeof(Block)) | flags;
 }
 static void* block_to_payload(Block* b) {
     return (void*)(b + 1);
 }
+static FreeLinks* links_of(Block* b) {
+    return (FreeLinks*)block_to_payload(b);
+}
+static Block* next_block(Block* b) {
+    return (Block*)((char*)block_to_payload(b) + block_size(b));
+}
+// Only valid when b has BLOCK_PREV_FREE: the footer of the previous block
+// is the word right before b.
+static Block* prev_block(Block* b) {
+    size_t prev_size = *((size_t*)b - 1);
+    return (Block*)((char*)b - prev_size - sizeof(Block));
+}
+static void mark_free(Block* b) {
+    block_set_flag(b, BLOCK_FREE, true);
+    *(size_t*)((char*)next_block(b) - sizeof(size_t)) = block_size(b);
+    block_set_flag(next_block(b), BLOCK_PREV_FREE, true);
+}
+static void mark_used(Block* b) {
+    block_set_flag(b, BLOCK_FREE, false);
+    block_set_flag(next_block(b), BLOCK_PREV_FREE, false);
+}
+static void set_fence(Block* b) {
+    b->head = 0;
+}
+// Free tree keys: the span in the header right before the node, then the
+// node's address. Part B headers change under other threads, hence the
+// atomic load.
+static size_t tree_span(FreeTree* n) {
+    return __atomic_load_n((size_t*)n - 1, __ATOMIC_RELAXED) & BLOCK_SPAN_MASK;
+}
+static bool tree_less(FreeTree* a, FreeTree* b) {
+    size_t sa = tree_span(a), sb = tree_span(b);
+    return sa < sb || (sa == sb && a < b);
+}
+static uint64_t tree_priority(FreeTree* n) {
+    return (uint64_t)(uintptr_t)n * 0x9E3779B97F4A7C15ull;
+}
+// Splits t into the nodes ordered before key and the rest.
+static void tree_split(FreeTree* t, FreeTree* key, FreeTree** l, FreeTree** r) {
+    if (!t) {
+        *l = *r = NULL;
+    } else if (tree_less(t, key)) {
+        *l = t;
+        tree_split(t->right, key, &t->right, r);
+    } else {
+        *r = t;
+        tree_split(t->left, key, l, &t->left);
+    }
+}
+// Joins two treaps where every node of a is ordered before those of b.
+static FreeTree* tree_merge(FreeTree* a, FreeTree* b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (tree_priority(a) > tree_priority(b)) {
+        a->right = tree_merge(a->right, b);
+        return a;
+    }
+    b->left = tree_merge(a, b->left);
+    return b;
+}
+static void tree_insert(FreeTree** root, FreeTree* n) {
+    while (*root && tree_priority(*root) > tree_priority(n)) {
+        root = tree_less(n, *root) ? &(*root)->left : &(*root)->right;
+    }
+    tree_split(*root, n, &n->left, &n->right);
+    *root = n;
+}
+static void tree_remove(FreeTree** root, FreeTree* n) {
+    while (*root != n) {
+        root = tree_less(n, *root) ? &(*root)->left : &(*root)->right;
+    }
+    *root = tree_merge(n->left, n->right);
+}
+// The smallest node with at least `span`, lowest address among equals.
+static FreeTree* tree_lower_bound(FreeTree* t, size_t span) {
+    FreeTree* best = NULL;
+    while (t) {
+        if (tree_span(t) >= span) {
+            best = t;
+            t = t->left;
+        } else {
+            t = t->right;
+        }
+    }
+    return best;
+}
+// Exact bins for sizes below SMALL_BIN_LIMIT.
+static size_t bin_index(size_t size) {
+    return (size - MIN_PAYLOAD) / SMALL_BIN_STEP;
+}
+static void bin_insert(Block* b) {
+    if (block_size(b) >= SMALL_BIN_LIMIT) {
+        tree_insert(&large_tree, (FreeTree*)block_to_payload(b));
+        return;
+    }
+    size_t idx = bin_index(block_size(b));
+    FreeLinks* l = links_of(b);
+    l->prev = NULL;
+    l->next = bins[idx];
+    if (bins[idx]) links_of(bins[idx])->prev = b;
+    bins[idx] = b;
+    binmap[idx / 64] |= (uint64_t)1 << (idx % 64);
+}
+static void bin_remove(Block* b) {
+    if (block_size(b) >= SMALL_BIN_LIMIT) {
+        tree_remove(&large_tree, (FreeTree*)block_to_payload(b));
+        return;
+    }
+    size_t idx = bin_index(block_size(b));
+    FreeLinks* l = links_of(b);
+    if (l->prev) links_of(l->prev)->next = l->next;
+    else bins[idx] = l->next;
+    if (l->next) links_of(l->next)->prev = l->prev;
+    if (!bins[idx]) binmap[idx / 64] &= ~((uint64_t)1 << (idx % 64));
+}
+// Returns the first non-empty bin at or after `from`, NUM_BINS if none.
+static size_t next_nonempty_bin(size_t from) {
+    size_t w = from / 64;
+    if (w >= BINMAP_WORDS) return NUM_BINS;
+    uint64_t bits = binmap[w] & (~(uint64_t)0 << (from % 64));
+    while (!bits) {
+        if (++w == BINMAP_WORDS) return NUM_BINS;
+        bits = binmap[w];
+    }
+    return w * 64 + (size_t)__builtin_ctzll(bits);
+}
 
+// The header sits right before the payload; accept it only if it lies
+// inside the heap and carries the tag for its own address.
 static Block* find_block_by_payload(void* payload) {
-    for (Block* it = blockList; it != NULL; it = it->next) {
-        if (block_to_payload(it) == payload) {
-            return it;
-        }
+    if (!heap_top) return NULL;
+    char* p = (char*)payload;
+    if (p < (char*)heap_start + sizeof(Block) || p > (char*)heap_top) {
+        return NULL;
     }
-    return NULL;
+    if ((uintptr_t)p % ALIGNMENT != 0) return NULL;
+    Block* b = (Block*)p - 1;
+    if ((b->head & ~(((size_t)1 << BLOCK_TAG_SHIFT) - 1)) != head_tag(b, BLOCK_MAGIC)) return NULL;
+    if (block_is(b, BLOCK_MMAPPED)) return NULL;
+    return b;
 }
+// Small requests take the first block of the first non-empty exact bin at
+// or above their size; everything else is a lower bound in the free tree.
 static Block* find_best_fit(size_t need) {
-    Block* best = NULL;
-    for (Block* it = blockList; it != NULL; it = it->next) {
-        if (it->free && it->size >= need) {
-            if (!best || it->size < best->size) {
-                best = it;
-            }
-        }
+    if (need < SMALL_BIN_LIMIT) {
+        size_t idx = next_nonempty_bin(bin_index(need));
+        if (idx < NUM_BINS) return bins[idx];
     }
-    return best;
+    FreeTree* n = tree_lower_bound(large_tree, need + sizeof(Block));
+    return n ? (Block*)n - 1 : NULL;
 }
 
+// Splits an in-use block; the tail becomes a free block, merged with the
+// block after it when that one is free as well.
 static void split_block_if_worth(Block* b, size_t need) {
     if (!b) return;
 
-    const size_t MIN_REMAIN = sizeof(Block) + 4;
-    if (b->size >= need + MIN_REMAIN) {
+    const size_t MIN_REMAIN = sizeof(Block) + MIN_PAYLOAD;
+    if (block_size(b) >= need + MIN_REMAIN) {
         char* base = (char*)b;
 
         Block* newb = (Block*)(base + sizeof(Block) + need);
-        newb->size = b->size - need - sizeof(Block);
-        newb->free = true;
-        newb->next = b->next;
+        block_stamp(newb, block_size(b) - need - sizeof(Block), 0);
+        block_set_size(b, need);
 
-        b->size = need;
-        b->next = newb;
+        Block* nxt = next_block(newb);
+        if (block_is(nxt, BLOCK_FREE)) {
+            bin_remove(nxt);
+            block_set_size(newb, block_size(newb) + sizeof(Block) + block_size(nxt));
+            nxt->head = 0;
+        }
+        mark_free(newb);
+        bin_insert(newb);
     }
 }
-static int are_adjacent(Block* a, Block* b) {
-    if (!a || !b) return 0;
-    char* end_a = (char*)a + sizeof(Block) + a->size;
-    return end_a == (char*)b;
+// Merges a block that is not in any bin with its free neighbours and
+// returns the resulting block (still not binned).
+static Block* coalesce_around(Block* b) {
+    if (!b) return NULL;
+    Block* nxt = next_block(b);
+    if (block_is(nxt, BLOCK_FREE)) {
+        bin_remove(nxt);
+        block_set_size(b, block_size(b) + sizeof(Block) + block_size(nxt));
+        nxt->head = 0;
+    }
+    if (block_is(b, BLOCK_PREV_FREE)) {
+        Block* prev = prev_block(b);
+        bin_remove(prev);
+        block_set_size(prev, block_size(prev) + sizeof(Block) + block_size(b));
+        b->head = 0;
+        b = prev;
+    }
+    return b;
 }
-static Block* find_prev(Block* target) {
-    if (!blockList || blockList == target) return NULL;
-    for (Block* it = blockList; it && it->next; it = it->next) {
-        if (it->next == target) return it;
+// Grows the heap by one in-use block. When the break is still right after
+// our last fence the fence becomes the new block's header (or the free tail
+// block is grown by the missing bytes), otherwise (someone else moved the
+// break) a new segment with its own fence starts.
+// Fresh break memory is zero except, possibly, for the rest of the page the
+// old break was in: a brk shrink only unmaps whole pages. *dirty receives
+// how many payload bytes calloc must still clear.
+static Block* extend_heap(size_t need, size_t* dirty) {
+    Block* nb;
+    uintptr_t old_brk = (uintptr_t)sbrk(0);
+    if (heap_top && (void*)(heap_top + 1) == sbrk(0)) {
+        if (block_is(heap_top, BLOCK_PREV_FREE)) {
+            nb = prev_block(heap_top);
+            bin_remove(nb);
+            if (sbrk((intptr_t)(need - block_size(nb))) == SBRK_FAIL) {
+                printf("<sbrk/brk error>: out of memory\n");
+                exit(1);
+            }
+        } else {
+            if (sbrk(need + sizeof(Block)) == SBRK_FAIL) {
+                printf("<sbrk/brk error>: out of memory\n");
+                exit(1);
+            }
+            nb = heap_top;
+        }
+    } else {
+        // the header goes one word below an ALIGNMENT boundary
+        size_t pad = (size_t)((sizeof(Block) - (uintptr_t)sbrk(0)) & (ALIGNMENT - 1));
+        char* mem = (char*)sbrk((intptr_t)(pad + need + 2 * sizeof(Block)));
+        if ((void*)mem == SBRK_FAIL) {
+            printf("<sbrk/brk error>: out of memory\n");
+            exit(1);
+        }
+        nb = (Block*)(mem + pad);
+        if (!blockList) {
+            blockList = nb;
+            list_pad = pad;
+        }
     }
-    return NULL;
+    // a new block's predecessor is never free: the free tail was taken over
+    block_stamp(nb, need, 0);
+    heap_top = next_block(nb);
+    set_fence(heap_top);
+    heap_stats.heap_bytes += (size_t)((uintptr_t)sbrk(0) - old_brk);
+    if (dirty) {
+        if (!page_size) page_size = (size_t)sysconf(_SC_PAGESIZE);
+        uintptr_t clean = (old_brk + page_size - 1) & ~(uintptr_t)(page_size - 1);
+        uintptr_t payload = (uintptr_t)block_to_payload(nb);
+        *dirty = clean > payload ? (size_t)(clean - payload) : 0;
+    }
+    return nb;
 }
-static void coalesce_around(Block* b) {
-    if (!b) return;
-    while (b->next && b->next->free && are_adjacent(b, b->next)) {
-        Block* nxt = b->next;
-        b->size += sizeof(Block) + nxt->size;
-        b->next = nxt->next;
-    }
-    Block* prev = find_prev(b);
-    if (prev && prev->free && are_adjacent(prev, b)) {
-        prev->size += sizeof(Block) + b->size;
-        prev->next = b->next;
-        b = prev;
-        while (b->next && b->next->free && are_adjacent(b, b->next)) {
-            Block* nxt = b->next;
-            b->size += sizeof(Block) + nxt->size;
-            b->next = nxt->next;
+// Grow a used block without moving it: take over the free block after it,
+// or move the break when the block ends the heap.
+static bool grow_in_place(Block* b, size_t need) {
+    Block* nxt = next_block(b);
+    bool nxt_free = block_is(nxt, BLOCK_FREE);
+    size_t avail = block_size(b);
+    if (nxt_free) avail += sizeof(Block) + block_size(nxt);
+    if (avail < need) {
+        Block* last = nxt_free ? next_block(nxt) : nxt;
+        if (last != heap_top || (void*)(heap_top + 1) != sbrk(0)) return false;
+        if (need >= mmap_threshold) return false;
+        if (sbrk((intptr_t)(need - avail)) == SBRK_FAIL) return false;
+        heap_stats.heap_bytes += need - avail;
+        if (nxt_free) {
+            bin_remove(nxt);
+            nxt->head = 0;
         }
+        block_set_size(b, need);
+        heap_top = next_block(b);
+        set_fence(heap_top);
+        return true;
+    }
+    bin_remove(nxt);
+    nxt->head = 0;
+    block_set_size(b, avail);
+    block_set_flag(next_block(b), BLOCK_PREV_FREE, false);
+    split_block_if_worth(b, need);
+    return true;
+}
+// A mapped chunk is a single Block in its own mapping, placed so that the
+// payload is aligned. alignment is at most a page, so the header always lies
+// in the first page and the mapping starts at the header's page. The span
+// ends a word short of the mapping, keeping it a multiple of ALIGNMENT.
+static Block* mmap_chunk_alloc(size_t need, size_t alignment, uint32_t magic) {
+    if (!page_size) page_size = (size_t)sysconf(_SC_PAGESIZE);
+    if (need > BLOCK_SPAN_MASK - alignment - page_size) return NULL;
+    size_t len = (sizeof(Block) + alignment + need + page_size - 1) & ~(page_size - 1);
+    char* mem = (char*)mmap(NULL, len, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((void*)mem == MAP_FAILED) return NULL;
+    uintptr_t payload = ((uintptr_t)mem + sizeof(Block) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    Block* b = (Block*)payload - 1;
+    b->head = head_tag(b, magic) | (size_t)(mem + len - (char*)payload) | BLOCK_MMAPPED;
+    return b;
+}
+// The caller must know the header right before the payload is readable.
+static Block* mmap_chunk_header(void* payload, uint32_t magic) {
+    Block* b = (Block*)payload - 1;
+    if ((b->head & ~BLOCK_SPAN_MASK) != (head_tag(b, magic) | BLOCK_MMAPPED)) return NULL;
+    return b;
+}
+// Reading the header is only safe when it shares the payload's page, which
+// holds for every chunk except page-aligned ones (Part A never maps those).
+static Block* mmap_chunk_lookup(void* payload, uint32_t magic) {
+    if (!page_size) return NULL;
+    if (((uintptr_t)payload & (page_size - 1)) < sizeof(Block)) return NULL;
+    if ((uintptr_t)payload % ALIGNMENT != 0) return NULL;
+    return mmap_chunk_header(payload, magic);
+}
+// Bytes in the mapping of a chunk.
+static size_t mmap_chunk_length(Block* b) {
+    char* base = (char*)((uintptr_t)b & ~(uintptr_t)(page_size - 1));
+    return (size_t)((char*)next_block(b) + sizeof(Block) - base);
+}
+static void mmap_chunk_free(Block* b) {
+    char* base = (char*)((uintptr_t)b & ~(uintptr_t)(page_size - 1));
+    size_t len = mmap_chunk_length(b);
+    b->head = 0;
+    if (munmap(base, len) != 0) {
+        printf("<munmap error>: failed to unmap block\n");
+        exit(1);
     }
 }
+// Resize a chunk with mremap, letting the kernel move the pages rather than
+// copying them. The header keeps its offset into the mapping but is
+// restamped, as the tag depends on its address. NULL leaves b untouched.
+static Block* mmap_chunk_resize(Block* b, size_t need, uint32_t magic) {
+    char* base = (char*)((uintptr_t)b & ~(uintptr_t)(page_size - 1));
+    size_t offset = (size_t)((char*)block_to_payload(b) - base);
+    size_t old_len = offset + block_size(b) + sizeof(Block);
+    if (need > BLOCK_SPAN_MASK - offset - page_size) return NULL;
+    size_t new_len = (offset + need + sizeof(Block) + page_size - 1) & ~(page_size - 1);
+    if (new_len == old_len) return b;
+    char* mem = (char*)mremap(base, old_len, new_len, MREMAP_MAYMOVE);
+    if ((void*)mem == MAP_FAILED) return NULL;
+    Block* nb = (Block*)(mem + offset) - 1;
+    nb->head = head_tag(nb, magic) | (new_len - offset) | BLOCK_MMAPPED;
+    return nb;
+}
+// Only the free block right before the top fence can be given back, and
+// only once it is worth a brk call.
 static void try_shrink_heap(void) {
-    while (blockList) {
-        Block* prev = NULL;
-        Block* last = blockList;
-        while (last->next) {
-            prev = last;
-            last = last->next;
-        }
-
-        if (!last->free) return;
+    if (!heap_top || !block_is(heap_top, BLOCK_PREV_FREE)) return;
+    Block* last = prev_block(heap_top);
+    if (block_size(last) < trim_threshold) return;
+    if ((void*)(heap_top + 1) != sbrk(0)) return;
 
-        void* cur_brk = sbrk(0);
-        char* end_last = (char*)last + sizeof(Block) + last->size;
-        if ((void*)end_last != cur_brk) return;
-        if (brk((void*)last) != 0) {
+    bin_remove(last);
+    last->head = 0;
+    char* old_brk = (char*)(heap_top + 1);
+    if (last == blockList) {
+        if (brk((void*)((char*)last - list_pad)) != 0) {
             printf("<sbrk/brk error>: out of memory\n");
             exit(1);
         }
-        if (prev) prev->next = NULL;
-        else blockList = NULL;
+        heap_stats.heap_bytes -= (size_t)(old_brk - ((char*)last - list_pad));
+        blockList = NULL;
+        heap_top = NULL;
+        return;
     }
+    if (brk((void*)(last + 1)) != 0) {
+        printf("<sbrk/brk error>: out of memory\n");
+        exit(1);
+    }
+    heap_stats.heap_bytes -= (size_t)(old_brk - (char*)(last + 1));
+    // the block before a free block is always in use
+    set_fence(last);
+    heap_top = last;
 }
-void* customMalloc(size_t size){
+void heapSetTrimThreshold(size_t bytes) {
+    trim_threshold = bytes;
+    try_shrink_heap();
+}
+void heapSetMmapThreshold(size_t bytes) {
+    mmap_threshold = bytes;
+}
+// Best fit from the bins, growing the heap when nothing fits.
+static Block* heap_alloc_block(size_t need, size_t* dirty) {
+    Block *allocate = find_best_fit(need);
+    if (allocate){
+        bin_remove(allocate);
+        mark_used(allocate);
+        split_block_if_worth(allocate, need);
+        if (dirty) *dirty = block_size(allocate);
+        return allocate;
+    }
+    return extend_heap(need, dirty);
+}
+// customMalloc, also reporting how much of the payload may be non-zero.
+static void* heap_malloc(size_t size, size_t* dirty) {
     if (size == 0)return NULL;
     init_heap_start_if_needed();
-    size_t need_size = align4(size);
-    Block *allocate = find_best_fit(need_size);
-    if (allocate){
-        allocate->free = false;
-        split_block_if_worth(allocate, need_size);
-        return block_to_payload(allocate);
+    if (size >= mmap_threshold) {
+        Block* mb = mmap_chunk_alloc(size, ALIGNMENT, BLOCK_MAGIC);
+        if (!mb) {
+            printf("<mmap error>: out of memory\n");
+            exit(1);
+        }
+        if (dirty) *dirty = 0;
+        heap_stats_count(mb, true);
+        return block_to_payload(mb);
+    }
+    Block* b = heap_alloc_block(payload_for(size), dirty);
+    heap_stats_count(b, true);
+    return block_to_payload(b);
+}
+
+static void* heap_aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) return NULL;
+    if (alignment <= ALIGNMENT) return customMalloc(size);
+    if (size == 0) return NULL;
+    init_heap_start_if_needed();
+    if (!page_size) page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t need_size = payload_for(size);
+    if (size >= mmap_threshold && alignment < page_size) {
+        Block* mb = mmap_chunk_alloc(need_size, alignment, BLOCK_MAGIC);
+        if (!mb) {
+            printf("<mmap error>: out of memory\n");
+            exit(1);
+        }
+        heap_stats_count(mb, true);
+        return block_to_payload(mb);
+    }
+    // Over-allocate, then give the bytes before the aligned address back as
+    // a free block of their own; the gap is either 0 or big enough for one.
+    const size_t MIN_GAP = sizeof(Block) + MIN_PAYLOAD;
+    Block* b = heap_alloc_block(need_size + alignment + MIN_GAP, NULL);
+    char* payload = (char*)block_to_payload(b);
+    char* aligned = (char*)(((uintptr_t)payload + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    if (aligned != payload && (size_t)(aligned - payload) < MIN_GAP) aligned += alignment;
+    if (aligned != payload) {
+        Block* ab = (Block*)aligned - 1;
+        block_stamp(ab, (size_t)(payload + block_size(b) - aligned), BLOCK_PREV_FREE);
+        block_set_size(b, (size_t)((char*)ab - payload));
+        // the leading part's neighbour before it is in use (it was free
+        // space or the heap end), so it only needs binning
+        mark_free(b);
+        bin_insert(b);
+        b = ab;
+    }
+    split_block_if_worth(b, need_size);
+    heap_stats_count(b, true);
+    return block_to_payload(b);
+}
+
+static void heap_free(void* ptr){
+    if (ptr == NULL){
+        printf ("<free error>: passed null pointer\n");
+        return;
     }
-    void* mem = sbrk(sizeof(Block) + need_size);
-    if (mem == SBRK_FAIL) {
+    init_heap_start_if_needed();
+    Block *cur_ptr = find_block_by_payload(ptr);
+    if (!cur_ptr) {
+        Block* mb = mmap_chunk_lookup(ptr, BLOCK_MAGIC);
+        if (mb) {
+            heap_stats_count(mb, false);
+            mmap_chunk_free(mb);
+            return;
+        }
+    }
+    if (!cur_ptr || block_is(cur_ptr, BLOCK_FREE)){
+        printf("<free error>: passed non-heap pointer\n");
+        return;
+    }
+heap_stats_count(cur_ptr, false);
+Block* merged = coalesce_around(cur_ptr);
+mark_free(merged);
+bin_insert(merged);
+try_shrink_heap();
+}
+static void* heap_calloc(size_t nmemb, size_t size){
+    if ( (nmemb == 0) || (size == 0)){
+        return NULL;
+    }
+    if (size != 0 && nmemb > (SIZE_MAX / size)) {
+        return NULL;
+    }
+    size_t mul= nmemb*size;
+    size_t dirty;
+    void *ptr_call = heap_malloc(mul, &dirty);
+    if (ptr_call == NULL)return NULL;
+    memset (ptr_call,0,dirty < mul ? dirty : mul);
+    return ptr_call;
+}
+static void* heap_realloc(void* ptr, size_t size) {
+    if (!ptr) {
+        ptr = customMalloc(size);
+        return ptr;
+    }
+    if (size == 0) {
+        customFree(ptr);
+        return NULL;
+    }
+    Block *new_block = find_block_by_payload(ptr);
+    if (!new_block) {
+        Block* mb = mmap_chunk_lookup(ptr, BLOCK_MAGIC);
+        if (mb) {
+            // stay in a mapping while the block is still worth one
+            if (size >= mmap_threshold) {
+                size_t old_size = block_size(mb);
+                size_t old_len = mmap_chunk_length(mb);
+                mb = mmap_chunk_resize(mb, size, BLOCK_MAGIC);
+                if (!mb) return NULL;
+                heap_stats_resized(mb, old_size);
+                heap_stats.mapped_bytes += mmap_chunk_length(mb) - old_len;
+                return block_to_payload(mb);
+            }
+            void *new_ptr = customMalloc(size);
+            memcpy(new_ptr, ptr, size < block_size(mb) ? size : block_size(mb));
+            heap_stats_count(mb, false);
+            mmap_chunk_free(mb);
+            return new_ptr;
+        }
+    }
+    if (!new_block || block_is(new_block, BLOCK_FREE)) {
+        printf("<realloc error>: passed non-heap pointer\n");
+        return NULL;
+    }
+    size_t new_size = payload_for(size);
+    size_t old = block_size(new_block);
+    if (new_size <= old) {
+        if (new_size == old) return ptr;
+        split_block_if_worth(new_block, new_size);
+        if (block_size(new_block) == new_size) {
+            heap_stats_resized(new_block, old);
+            return block_to_payload(new_block);
+        }
+        void *new_ptr = customMalloc(size);
+        if (!new_ptr)return NULL;
+        memcpy(new_ptr, ptr, size);
+        customFree(ptr);
+        return new_ptr;
+    }
+    if (grow_in_place(new_block, new_size)) {
+        heap_stats_resized(new_block, old);
+        return ptr;
+    }
+    void *new_ptr = customMalloc(size);
+    if (!new_ptr)return NULL;
+    memcpy(new_ptr, ptr, old);
+    customFree(ptr);
+    return new_ptr;
+}
+
+// The public Part A calls, recording into the open trace
+void* customMalloc(size_t size){
+    if (!trace_wanted()) return heap_malloc(size, NULL);
+    trace_begin(NULL);
+    return trace_end(TRACE_MALLOC, 0, NULL, heap_malloc(size, NULL), size, 0);
+}
+void* customAlignedAlloc(size_t alignment, size_t size) {
+    if (!trace_wanted()) return heap_aligned_alloc(alignment, size);
+    trace_begin(NULL);
+    return trace_end(TRACE_ALIGNED, 0, NULL, heap_aligned_alloc(alignment, size), size, alignment);
+}
+void customFree(void* ptr){
+    if (!trace_wanted()) {
+        heap_free(ptr);
+        return;
+    }
+    uint32_t id = trace_begin(ptr);
+    heap_free(ptr);
+    trace_end(TRACE_FREE, id, ptr, NULL, 0, 0);
+}
+void* customCalloc(size_t nmemb, size_t size){
+    if (!trace_wanted()) return heap_calloc(nmemb, size);
+    trace_begin(NULL);
+    return trace_end(TRACE_CALLOC, 0, NULL, heap_calloc(nmemb, size), nmemb * size, 0);
+}
+void* customRealloc(void* ptr, size_t size) {
+    if (!trace_wanted()) return heap_realloc(ptr, size);
+    uint32_t id = trace_begin(ptr);
+    return trace_end(TRACE_REALLOC, id, ptr, heap_realloc(ptr, size), size, 0);
+}
+
+// Size class of a block with `size` usable bytes, see STATS_SIZE_CLASSES.
+static size_t stats_class(size_t size) {
+    if (size <= 16) return 0;
+    size_t c = (size_t)(60 - __builtin_clzl((unsigned long)(size - 1)));
+    return c < STATS_SIZE_CLASSES ? c : STATS_SIZE_CLASSES - 1;
+}
+static void heap_stats_count(Block* b, bool alloc) {
+    size_t size = block_size(b);
+    size_t c = stats_class(size);
+    bool mapped = block_is(b, BLOCK_MMAPPED);
+    if (alloc) {
+        prof_alloc(block_to_payload(b), size);
+        heap_stats.allocs[c]++;
+        heap_stats.in_use_bytes += size;
+        heap_stats.in_use_blocks++;
+        if (mapped) {
+            heap_stats.mapped_bytes += mmap_chunk_length(b);
+            heap_stats.mapped_blocks++;
+        }
+    } else {
+        prof_free(block_to_payload(b));
+        heap_stats.frees[c]++;
+        heap_stats.in_use_bytes -= size;
+        heap_stats.in_use_blocks--;
+        if (mapped) {
+            heap_stats.mapped_bytes -= mmap_chunk_length(b);
+            heap_stats.mapped_blocks--;
+        }
+    }
+}
+// An in-place realloc counts as freeing the old block and allocating the
+// new one.
+static void heap_stats_resized(Block* b, size_t old_size) {
+    prof_free(block_to_payload(b));
+    prof_alloc(block_to_payload(b), block_size(b));
+    heap_stats.frees[stats_class(old_size)]++;
+    heap_stats.allocs[stats_class(block_size(b))]++;
+    heap_stats.in_use_bytes += block_size(b) - old_size;
+}
+// Adds up the free blocks of a free tree; the largest is the rightmost.
+static void tree_stats(FreeTree* t, AllocStats* stats) {
+    for (; t; t = t->right) {
+        size_t size = tree_span(t) - sizeof(Block);
+        stats->free_bytes += size;
+        stats->free_blocks++;
+        if (size > stats->largest_free) stats->largest_free = size;
+        tree_stats(t->left, stats);
+    }
+}
+AllocStats customMallocStats(void) {
+    AllocStats stats = heap_stats;
+    stats.free_bytes = 0;
+    stats.free_blocks = 0;
+    stats.largest_free = 0;
+    for (size_t idx = 0; idx < NUM_BINS; idx++) {
+        for (Block* it = bins[idx]; it != NULL; it = links_of(it)->next) {
+            stats.free_bytes += block_size(it);
+            stats.free_blocks++;
+            if (block_size(it) > stats.largest_free) stats.largest_free = block_size(it);
+        }
+    }
+    tree_stats(large_tree, &stats);
+    return stats;
+}
+
+/*=============================================================================
+* Sampling heap profiler
+=============================================================================*/
+static size_t prof_interval = 0;           // Mean bytes between samples, 0 when stopped
+static HeapSample** prof_table = NULL;     // PROF_BUCKETS chains, kept once created
+static HeapSample* prof_spare = NULL;      // Unused samples
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread size_t prof_countdown;     // Bytes until this thread's next sample
+static __thread uint64_t prof_seed;        // This thread's random state, 0 until first use
+static __thread bool prof_busy;            // backtrace() may allocate itself
+
+// Bucket of ptr in a table of `buckets` (a power of two up to 1 << 32) chains
+static size_t ptr_hash(void* ptr, size_t buckets) {
+    return (size_t)(((uint64_t)(uintptr_t)ptr * 0x9E3779B97F4A7C15ull) >> 32) & (buckets - 1);
+}
+// Bytes to the next sample: -ln(U) * interval for uniform U, with log2
+// taken from the bit length and a linear mantissa (no libm needed).
+static size_t prof_next_interval(size_t interval) {
+    if (!prof_seed) prof_seed = ((uint64_t)(uintptr_t)&prof_seed * 0x9E3779B97F4A7C15ull) | 1;
+    prof_seed ^= prof_seed << 13;
+    prof_seed ^= prof_seed >> 7;
+    prof_seed ^= prof_seed << 17;
+    uint32_t x = (uint32_t)(prof_seed >> 40) | 1;     // 24 random bits
+    int e = 31 - __builtin_clz(x);
+    double log2x = e + (double)(x - ((uint32_t)1 << e)) / (double)((uint32_t)1 << e);
+    return (size_t)((24.0 - log2x) * 0.6931471805599453 * (double)interval) + 1;
+}
+// Memory for the profiler and trace tables, kept out of both heaps
+static void* meta_map(size_t len) {
+    void* mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return mem == MAP_FAILED ? NULL : mem;
+}
+// Keeps a sample for ptr; called outside the lock to take the backtrace.
+static void prof_record(void* ptr, size_t size) {
+    void* stack[PROF_MAX_DEPTH + 2];
+    int depth = backtrace(stack, PROF_MAX_DEPTH + 2);
+    // drop prof_record and prof_alloc themselves
+    depth = depth > 2 ? depth - 2 : 0;
+    pthread_mutex_lock(&prof_lock);
+    if (!prof_spare) {
+        size_t len = 64 * 1024;
+        HeapSample* chunk = (HeapSample*)meta_map(len);
+        for (size_t i = 0; chunk && i < len / sizeof(HeapSample); i++) {
+            chunk[i].next = prof_spare;
+            prof_spare = &chunk[i];
+        }
+    }
+    HeapSample* sample = prof_spare;
+    if (sample) {
+        prof_spare = sample->next;
+        sample->ptr = ptr;
+        sample->size = size;
+        sample->depth = depth;
+        memcpy(sample->stack, stack + 2, (size_t)depth * sizeof(void*));
+        size_t h = ptr_hash(ptr, PROF_BUCKETS);
+        sample->next = prof_table[h];
+        __atomic_store_n(&prof_table[h], sample, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+static void prof_alloc(void* ptr, size_t size) {
+    size_t interval = __atomic_load_n(&prof_interval, __ATOMIC_RELAXED);
+    if (!interval) return;
+    if (prof_countdown > size) {
+        prof_countdown -= size;
+        return;
+    }
+    if (prof_busy) return;
+    prof_busy = true;
+    // a thread's first allocation only draws its first interval
+    bool first = prof_seed == 0;
+    prof_countdown = prof_next_interval(interval);
+    if (!first) prof_record(ptr, size);
+    prof_busy = false;
+}
+// Most frees only find their bucket empty, without taking the lock. A
+// sampled block is freed after its sample was inserted, so the check
+// cannot miss it.
+static void prof_free(void* ptr) {
+    HeapSample** table = __atomic_load_n(&prof_table, __ATOMIC_ACQUIRE);
+    if (!table) return;
+    size_t h = ptr_hash(ptr, PROF_BUCKETS);
+    if (!__atomic_load_n(&table[h], __ATOMIC_RELAXED)) return;
+    pthread_mutex_lock(&prof_lock);
+    for (HeapSample** link = &table[h]; *link; link = &(*link)->next) {
+        if ((*link)->ptr == ptr) {
+            HeapSample* sample = *link;
+            __atomic_store_n(link, sample->next, __ATOMIC_RELAXED);
+            sample->next = prof_spare;
+            prof_spare = sample;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+void heapProfileStart(size_t sample_bytes) {
+    if (sample_bytes == 0) return;
+    // let backtrace load what it needs now rather than while sampling
+    void* warmup[1];
+    backtrace(warmup, 1);
+    pthread_mutex_lock(&prof_lock);
+    if (!prof_table) {
+        HeapSample** table = (HeapSample**)meta_map(PROF_BUCKETS * sizeof(HeapSample*));
+        if (table) __atomic_store_n(&prof_table, table, __ATOMIC_RELEASE);
+    }
+    if (prof_table) __atomic_store_n(&prof_interval, sample_bytes, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&prof_lock);
+}
+void heapProfileStop(void) {
+    pthread_mutex_lock(&prof_lock);
+    __atomic_store_n(&prof_interval, 0, __ATOMIC_RELAXED);
+    for (size_t h = 0; prof_table && h < PROF_BUCKETS; h++) {
+        while (prof_table[h]) {
+            HeapSample* sample = prof_table[h];
+            __atomic_store_n(&prof_table[h], sample->next, __ATOMIC_RELAXED);
+            sample->next = prof_spare;
+            prof_spare = sample;
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+static bool prof_write(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) return false;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+int heapProfileDump(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    char line[64 + PROF_MAX_DEPTH * 20];
+    bool ok = true;
+    pthread_mutex_lock(&prof_lock);
+    size_t count = 0, bytes = 0;
+    for (size_t h = 0; prof_table && h < PROF_BUCKETS; h++) {
+        for (HeapSample* s = prof_table[h]; s; s = s->next) {
+            count++;
+            bytes += s->size;
+        }
+    }
+    int len = snprintf(line, sizeof(line), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                       count, bytes, count, bytes, prof_interval);
+    ok = prof_write(fd, line, (size_t)len);
+    for (size_t h = 0; ok && prof_table && h < PROF_BUCKETS; h++) {
+        for (HeapSample* s = prof_table[h]; ok && s; s = s->next) {
+            len = snprintf(line, sizeof(line), "1: %zu [1: %zu] @", s->size, s->size);
+            for (int i = 0; i < s->depth; i++) {
+                len += snprintf(line + len, sizeof(line) - (size_t)len, " %p", s->stack[i]);
+            }
+            line[len++] = '\n';
+            ok = prof_write(fd, line, (size_t)len);
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+    // pprof maps the addresses to binaries with this section
+    ok = ok && prof_write(fd, "\nMAPPED_LIBRARIES:\n", 19);
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0) {
+        ssize_t n;
+        while (ok && (n = read(maps, line, sizeof(line))) > 0) {
+            ok = prof_write(fd, line, (size_t)n);
+        }
+        close(maps);
+    }
+    if (close(fd) != 0) ok = false;
+    return ok ? 0 : -1;
+}
+
+/*=============================================================================
+* Allocation trace
+=============================================================================*/
+static int trace_fd = -1;                  // Open trace, -1 when not tracing
+static bool trace_failed = false;          // A write to it failed
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceRecord trace_buf[TRACE_BUFFER];
+static size_t trace_used = 0;              // Records in trace_buf
+static uint32_t trace_last_id = 0;
+static uint64_t trace_epoch = 0;           // Start time of the trace
+static TraceEntry** trace_table = NULL;    // Live traced blocks, kept once created
+static TraceEntry* trace_spare = NULL;
+static uint16_t trace_last_thread = 0;
+static __thread uint16_t trace_thread;     // 0 until the thread's first traced call
+static __thread bool trace_nested;         // Inside a traced call
+
+static uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+static void trace_flush(void) {
+    if (trace_used && !prof_write(trace_fd, (const char*)trace_buf, trace_used * sizeof(TraceRecord))) {
+        trace_failed = true;
+    }
+    trace_used = 0;
+}
+static void trace_put(void* ptr, uint32_t id) {
+    if (!trace_spare) {
+        size_t len = 64 * 1024;
+        TraceEntry* chunk = (TraceEntry*)meta_map(len);
+        for (size_t i = 0; chunk && i < len / sizeof(TraceEntry); i++) {
+            chunk[i].next = trace_spare;
+            trace_spare = &chunk[i];
+        }
+        if (!trace_spare) return;
+    }
+    TraceEntry* e = trace_spare;
+    trace_spare = e->next;
+    e->ptr = ptr;
+    e->id = id;
+    size_t h = ptr_hash(ptr, TRACE_BUCKETS);
+    e->next = trace_table[h];
+    trace_table[h] = e;
+}
+static uint32_t trace_take(void* ptr) {
+    for (TraceEntry** link = &trace_table[ptr_hash(ptr, TRACE_BUCKETS)]; *link; link = &(*link)->next) {
+        if ((*link)->ptr == ptr) {
+            TraceEntry* e = *link;
+            *link = e->next;
+            e->next = trace_spare;
+            trace_spare = e;
+            return e->id;
+        }
+    }
+    return 0;
+}
+static void trace_forget_all(void) {
+    for (size_t h = 0; trace_table && h < TRACE_BUCKETS; h++) {
+        while (trace_table[h]) trace_take(trace_table[h]->ptr);
+    }
+}
+// One relaxed load while no trace is open
+static bool trace_wanted(void) {
+    return __atomic_load_n(&trace_fd, __ATOMIC_RELAXED) >= 0 && !trace_nested;
+}
+// Starts a traced call: hides the calls it makes and returns the id of the
+// block it frees or resizes (0 if that one is not traced). The id is taken
+// before the block is released, so its address cannot be reused and
+// traced by another thread first.
+static uint32_t trace_begin(void* old) {
+    trace_nested = true;
+    if (!old) return 0;
+    pthread_mutex_lock(&trace_lock);
+    uint32_t id = trace_fd >= 0 ? trace_take(old) : 0;
+    pthread_mutex_unlock(&trace_lock);
+    return id;
+}
+// Records a traced call that returned `result`, and returns that.
+static void* trace_end(int op, uint32_t id, void* old, void* result, size_t size, size_t alignment) {
+    trace_nested = false;
+    int kind = op & ~TRACE_MT;
+    if (kind == TRACE_REALLOC) {
+        if (!old) {
+            op = TRACE_MALLOC | (op & TRACE_MT);
+        } else if (size == 0) {
+            op = TRACE_FREE | (op & TRACE_MT);
+        } else if (!result) {
+            // failed, the old block is still live
+            if (!id) return NULL;
+            pthread_mutex_lock(&trace_lock);
+            if (trace_fd >= 0) trace_put(old, id);
+            pthread_mutex_unlock(&trace_lock);
+            return NULL;
+        } else if (!id) {
+            op = TRACE_MALLOC | (op & TRACE_MT);
+        }
+        kind = op & ~TRACE_MT;
+    }
+    if (kind == TRACE_FREE ? id == 0 : result == NULL) return result;
+    
+    uint64_t now = trace_now();
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        if (kind != TRACE_FREE) {
+            if (kind != TRACE_REALLOC) id = ++trace_last_id;
+            trace_put(result, id);
+        }
+        if (!trace_thread) trace_thread = ++trace_last_thread;
+        TraceRecord* r = &trace_buf[trace_used++];
+        r->time_ns = now > trace_epoch ? now - trace_epoch : 0;
+        r->size = size;
+        r->id = id;
+        r->thread = trace_thread;
+        r->op = (uint8_t)op;
+        r->align_shift = alignment ? (uint8_t)__builtin_ctzl((unsigned long)alignment) : 0;
+        if (trace_used == TRACE_BUFFER) trace_flush();
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return result;
+}
+int heapTraceStart(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    uint64_t magic = TRACE_MAGIC;
+    pthread_mutex_lock(&trace_lock);
+    if (!trace_table) trace_table = (TraceEntry**)meta_map(TRACE_BUCKETS * sizeof(TraceEntry*));
+    if (trace_fd >= 0 || !trace_table || !prof_write(fd, (const char*)&magic, sizeof(magic))) {
+        pthread_mutex_unlock(&trace_lock);
+        close(fd);
+        return -1;
+    }
+    trace_failed = false;
+    trace_last_id = 0;
+    trace_epoch = trace_now();
+    __atomic_store_n(&trace_fd, fd, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+int heapTraceStop(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd < 0) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    trace_flush();
+    if (close(trace_fd) != 0) trace_failed = true;
+    __atomic_store_n(&trace_fd, -1, __ATOMIC_RELAXED);
+    trace_forget_all();
+    pthread_mutex_unlock(&trace_lock);
+    return trace_failed ? -1 : 0;
+}
+
+/*=============================================================================
+* Part B - Multi-threaded Memory Allocator Implementation
+=============================================================================*/
+
+// Global state for multi-threaded allocator
+static MemRegion* mt_regions = NULL;       // Array of initial regions
+static MemRegion* mt_extra_regions = NULL; // Linked list of dynamically added regions
+static MemRegion*** mt_region_map[MT_MAP_FANOUT]; // Radix tree root, see MT_MAP_BITS
+static MemRegion mt_mmap_marker;           // Map value for page-aligned mapped payloads
+static MemRegion* mt_struct_pool = NULL;   // Spare MemRegion structs for new regions
+static size_t mt_struct_pool_left = 0;
+static MTArena mt_arenas[MT_ARENAS];       // Home region groups
+static unsigned mt_thread_counter = 0;     // Hands out home arenas
+static __thread int mt_home_arena = -1;    // This thread's arena, -1 until first use
+static pthread_mutex_t mt_global_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool mt_initialized = false;
+static unsigned mt_generation = 0;         // Bumped by heapKill, invalidates caches
+static __thread MTCache mt_tcache;         // This thread's cache
+static pthread_key_t mt_tcache_key;        // Flushes the cache on thread exit
+static pthread_once_t mt_tcache_key_once = PTHREAD_ONCE_INIT;
+static bool mt_percpu_cache = false;       // Park blocks per CPU, see MTCPUCache
+static MTCPUCache* mt_cpu_caches = NULL;   // One per configured CPU, never freed
+static size_t mt_cpu_count = 0;
+static __thread MTThreadStats mt_tstats;   // This thread's counters
+static MTThreadStats* mt_stats_threads = NULL; // Linked thread counters
+static MTThreadStats mt_stats_retired;     // Counters of exited threads
+static AllocStats mt_stats_base;           // Counter totals at the last heapKill
+static pthread_key_t mt_stats_key;         // Retires the counters on thread exit
+static pthread_once_t mt_stats_key_once = PTHREAD_ONCE_INIT;
+
+// Helper: Payload size for a request, see payload_for
+static size_t mt_payload_for(size_t x) {
+    size_t size = (size_t)ALIGN_TO_MULT_OF_16(x + sizeof(MTBlock)) - sizeof(MTBlock);
+    return size < MT_MIN_PAYLOAD ? MT_MIN_PAYLOAD : size;
+}
+
+// Helpers: Header word access. Flags of an allocated block may be flipped
+// by its owner without the region lock, so every access is atomic.
+static size_t mt_head(MTBlock* b) {
+    return __atomic_load_n(&b->head, __ATOMIC_RELAXED);
+}
+
+static void mt_set_head(MTBlock* b, size_t head) {
+    __atomic_store_n(&b->head, head, __ATOMIC_RELAXED);
+}
+
+static size_t mt_block_size(MTBlock* b) {
+    return (mt_head(b) & BLOCK_SPAN_MASK) - sizeof(MTBlock);
+}
+
+static bool mt_block_is(MTBlock* b, size_t flag) {
+    return (mt_head(b) & flag) != 0;
+}
+
+static void mt_block_set_flag(MTBlock* b, size_t flag, bool on) {
+    if (on) __atomic_fetch_or(&b->head, flag, __ATOMIC_RELAXED);
+    else __atomic_fetch_and(&b->head, ~flag, __ATOMIC_RELAXED);
+}
+
+static void mt_block_set_size(MTBlock* b, size_t size) {
+    size_t head = mt_head(b);
+    while (!__atomic_compare_exchange_n(&b->head, &head,
+                                        (head & ~BLOCK_SPAN_MASK) | (size + sizeof(MTBlock)),
+                                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Helper: Write a complete header for a region block at b
+static void mt_block_stamp(MTBlock* b, size_t size, size_t flags) {
+    mt_set_head(b, head_tag(b, MT_BLOCK_MAGIC) | (size + sizeof(MTBlock)) | flags);
+}
+
+// Helper: Convert MTBlock to payload pointer
+static void* mt_block_to_payload(MTBlock* b) {
+    return (void*)(b + 1);
+}
+
+// Helpers: Neighbours in address order; the previous one only when the
+// block has BLOCK_PREV_FREE, through the footer right before the header
+static MTBlock* mt_next_block(MTBlock* b) {
+    return (MTBlock*)((char*)mt_block_to_payload(b) + mt_block_size(b));
+}
+
+static MTBlock* mt_prev_block(MTBlock* b) {
+    size_t prev_size = *((size_t*)b - 1);
+    return (MTBlock*)((char*)b - prev_size - sizeof(MTBlock));
+}
+
+static MTBlock* mt_first_block(MemRegion* region) {
+    return (MTBlock*)region->start + 1;
+}
+
+static void mt_mark_free(MTBlock* b) {
+    mt_block_set_flag(b, BLOCK_FREE, true);
+    *(size_t*)((char*)mt_next_block(b) - sizeof(size_t)) = mt_block_size(b);
+    mt_block_set_flag(mt_next_block(b), BLOCK_PREV_FREE, true);
+}
+
+static void mt_mark_used(MTBlock* b) {
+    mt_block_set_flag(b, BLOCK_FREE, false);
+    mt_block_set_flag(mt_next_block(b), BLOCK_PREV_FREE, false);
+}
+
+// Helpers: Region free tree, see FreeTree
+static FreeTree* mt_tree_node_of(MTBlock* b) {
+    return (FreeTree*)mt_block_to_payload(b);
+}
+
+static void mt_free_insert(MemRegion* region, MTBlock* b) {
+    tree_insert(&region->free_tree, mt_tree_node_of(b));
+}
+
+static void mt_free_remove(MemRegion* region, MTBlock* b) {
+    tree_remove(&region->free_tree, mt_tree_node_of(b));
+}
+
+// Helper: Find best fit block in a region, a lower bound in its free tree
+static MTBlock* mt_find_best_fit(MemRegion* region, size_t need) {
+    FreeTree* n = tree_lower_bound(region->free_tree, need + sizeof(MTBlock));
+    return n ? (MTBlock*)n - 1 : NULL;
+}
+
+// Helper: Split block if there's enough remaining space. The free tail
+// keeps the zeroed bit of b and merges with a free block after it.
+static void mt_split_block_if_worth(MemRegion* region, MTBlock* b, size_t need) {
+    if (!b) return;
+    const size_t MIN_REMAIN = sizeof(MTBlock) + MT_MIN_PAYLOAD;
+    size_t size = mt_block_size(b);
+    if (size >= need + MIN_REMAIN) {
+        char* base = (char*)b;
+        MTBlock* newb = (MTBlock*)(base + sizeof(MTBlock) + need);
+        mt_block_stamp(newb, size - need - sizeof(MTBlock), mt_head(b) & MT_BLOCK_ZEROED);
+        mt_block_set_size(b, need);
+        MTBlock* nxt = mt_next_block(newb);
+        if (mt_block_is(nxt, BLOCK_FREE)) {
+            mt_free_remove(region, nxt);
+            mt_block_set_size(newb, mt_block_size(newb) + sizeof(MTBlock) + mt_block_size(nxt));
+            mt_block_set_flag(newb, MT_BLOCK_ZEROED, false);
+            mt_set_head(nxt, 0);
+        }
+        mt_mark_free(newb);
+        mt_free_insert(region, newb);
+    }
+}
+
+// Helper: Free an allocated block, merging it with free neighbours
+// (region lock held)
+static void mt_release_block(MemRegion* region, MTBlock* b) {
+    MTBlock* nxt = mt_next_block(b);
+    if (mt_block_is(nxt, BLOCK_FREE)) {
+        mt_free_remove(region, nxt);
+        mt_block_set_size(b, mt_block_size(b) + sizeof(MTBlock) + mt_block_size(nxt));
+        mt_set_head(nxt, 0);
+    }
+    if (mt_block_is(b, BLOCK_PREV_FREE)) {
+        MTBlock* prev = mt_prev_block(b);
+        mt_free_remove(region, prev);
+        mt_block_set_size(prev, mt_block_size(prev) + sizeof(MTBlock) + mt_block_size(b));
+        mt_set_head(b, 0);
+        b = prev;
+    }
+    mt_block_set_flag(b, MT_BLOCK_ZEROED, false);
+    mt_mark_free(b);
+    mt_free_insert(region, b);
+}
+
+// Helper: Find block by payload in a region; the header right before the
+// payload must carry the tag for its address
+static MTBlock* mt_find_block_by_payload(MemRegion* region, void* payload) {
+    char* p = (char*)payload;
+    char* start = (char*)region->start;
+    if (p < start + 2 * sizeof(MTBlock) || p >= start + region->total_size) {
+        return NULL;
+    }
+    if ((uintptr_t)p % ALIGNMENT != 0) return NULL;
+    MTBlock* block = (MTBlock*)p - 1;
+    if ((mt_head(block) & ~(((size_t)1 << BLOCK_TAG_SHIFT) - 1)) != head_tag(block, MT_BLOCK_MAGIC)) {
+        return NULL;
+    }
+    return block;
+}
+
+// Helper: Initialize a region with given memory
+static void mt_init_region(MemRegion* region, void* mem, size_t size, int arena) {
+    region->start = mem;
+    region->total_size = size;
+    pthread_mutex_init(&region->lock, NULL);
+    region->next = NULL;
+    region->arena_next = NULL;
+    region->arena = arena;
+    region->remote_frees = NULL;
+    region->slab_size = 0;
+    region->free_tree = NULL;
+    
+    // A single free block between the padding word and the fence
+    MTBlock* initial_block = mt_first_block(region);
+    mt_block_stamp(initial_block, size - 3 * sizeof(MTBlock), MT_BLOCK_ZEROED);
+    mt_set_head((MTBlock*)((char*)mem + size) - 1, 0);
+    mt_mark_free(initial_block);
+    mt_free_insert(region, initial_block);
+}
+
+// Helper: Find which region contains a pointer (lock-free)
+static MemRegion* mt_find_region_for_ptr(void* ptr) {
+    uintptr_t key = (uintptr_t)ptr >> MT_REGION_SHIFT;
+    if (key >> (3 * MT_MAP_BITS)) return NULL;
+    MemRegion*** mid = __atomic_load_n(&mt_region_map[key >> (2 * MT_MAP_BITS)], __ATOMIC_ACQUIRE);
+    if (!mid) return NULL;
+    MemRegion** leaf = __atomic_load_n(&mid[(key >> MT_MAP_BITS) & (MT_MAP_FANOUT - 1)], __ATOMIC_ACQUIRE);
+    if (!leaf) return NULL;
+    return __atomic_load_n(&leaf[key & (MT_MAP_FANOUT - 1)], __ATOMIC_ACQUIRE);
+}
+
+// Helper: Allocate a zeroed radix tree node
+static void* mt_map_node_alloc(void) {
+    void* node = mmap(NULL, MT_MAP_FANOUT * sizeof(void*), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (node == MAP_FAILED) {
+        printf("<mmap error>: out of memory\n");
+        exit(1);
+    }
+    return node;
+}
+
+// Helper: Point the map entry covering `addr` at `value` (global lock held)
+static void mt_map_set(void* addr, MemRegion* value) {
+    uintptr_t key = (uintptr_t)addr >> MT_REGION_SHIFT;
+    MemRegion*** mid = mt_region_map[key >> (2 * MT_MAP_BITS)];
+    if (!mid) {
+        mid = (MemRegion***)mt_map_node_alloc();
+        __atomic_store_n(&mt_region_map[key >> (2 * MT_MAP_BITS)], mid, __ATOMIC_RELEASE);
+    }
+    MemRegion** leaf = mid[(key >> MT_MAP_BITS) & (MT_MAP_FANOUT - 1)];
+    if (!leaf) {
+        leaf = (MemRegion**)mt_map_node_alloc();
+        __atomic_store_n(&mid[(key >> MT_MAP_BITS) & (MT_MAP_FANOUT - 1)], leaf, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&leaf[key & (MT_MAP_FANOUT - 1)], value, __ATOMIC_RELEASE);
+}
+
+// Helper: Find the mapped chunk of a pointer that is not in any region.
+// Page-aligned payloads have their header on the page before, so they are
+// only trusted when the map marks them.
+static Block* mt_mapped_lookup(void* ptr, MemRegion* region) {
+    if (region == &mt_mmap_marker) return mmap_chunk_header(ptr, MT_BLOCK_MAGIC);
+    return mmap_chunk_lookup(ptr, MT_BLOCK_MAGIC);
+}
+
+// Helper: Unmap a chunk, dropping its map entry if it has one
+static void mt_mapped_free(Block* mb) {
+    void* payload = block_to_payload(mb);
+    if (((uintptr_t)payload & (page_size - 1)) == 0) {
+        pthread_mutex_lock(&mt_global_lock);
+        mt_map_set(payload, NULL);
+        pthread_mutex_unlock(&mt_global_lock);
+    }
+    mmap_chunk_free(mb);
+}
+
+// Helper: mremap a chunk, moving its map entry along with it. The entry is
+// dropped first: once mremap releases the old pages another thread may map
+// them and mark the same slot.
+static void* mt_mapped_resize(Block* mb, size_t size) {
+    void* payload = block_to_payload(mb);
+    bool marked = ((uintptr_t)payload & (page_size - 1)) == 0;
+    if (marked) {
+        pthread_mutex_lock(&mt_global_lock);
+        mt_map_set(payload, NULL);
+        pthread_mutex_unlock(&mt_global_lock);
+    }
+    Block* nb = mmap_chunk_resize(mb, size, MT_BLOCK_MAGIC);
+    if (marked) {
+        pthread_mutex_lock(&mt_global_lock);
+        mt_map_set(block_to_payload(nb ? nb : mb), &mt_mmap_marker);
+        pthread_mutex_unlock(&mt_global_lock);
+    }
+    return nb ? block_to_payload(nb) : NULL;
+}
+
+// Helper: sbrk `size` bytes starting at an `alignment` boundary. Region
+// memory uses MT_REGION_SIZE, so every region owns exactly one map entry;
+// region structures use MT_CACHE_LINE.
+static void* mt_sbrk_aligned(size_t size, size_t alignment) {
+    uintptr_t cur = (uintptr_t)sbrk(0);
+    size_t pad = (size_t)(-cur & (alignment - 1));
+    char* mem = (char*)sbrk((intptr_t)(pad + size));
+    if ((void*)mem == SBRK_FAIL) {
         printf("<sbrk/brk error>: out of memory\n");
         exit(1);
     }
+    return mem + pad;
+}
+
+// Helper: Create a new extra region
+static MemRegion* mt_create_extra_region(int arena) {
+    // Region structures are carved from their own chunk, keeping the
+    // region memory itself aligned
+    if (mt_struct_pool_left == 0) {
+        mt_struct_pool = (MemRegion*)mt_sbrk_aligned(MT_REGION_SIZE, MT_CACHE_LINE);
+        mt_struct_pool_left = MT_REGION_SIZE / sizeof(MemRegion);
+    }
+    MemRegion* new_region = mt_struct_pool++;
+    mt_struct_pool_left--;
+    
+    // Allocate memory for the region's heap space
+    void* heap_mem = mt_sbrk_aligned(MT_REGION_SIZE, MT_REGION_SIZE);
+    
+    mt_init_region(new_region, heap_mem, MT_REGION_SIZE, arena);
+    mt_map_set(new_region->start, new_region);
+    
+    // Add to extra regions list
+    new_region->next = mt_extra_regions;
+    mt_extra_regions = new_region;
+    
+    return new_region;
+}
+
+// Helper: Get the calling thread's arena, assigning one round-robin
+static MTArena* mt_get_home_arena(void) {
+    if (mt_home_arena < 0) {
+        unsigned n = __atomic_fetch_add(&mt_thread_counter, 1, __ATOMIC_RELAXED);
+        mt_home_arena = (int)(n % MT_ARENAS);
+    }
+    return &mt_arenas[mt_home_arena];
+}
+
+// Helper: Turn a fresh region into a slab of `size` byte objects; bits past
+// the last whole object start out set so they are never handed out
+static void mt_make_slab(MemRegion* region, size_t size) {
+    size_t objects = region->total_size / size;
+    region->slab_size = size;
+    region->free_tree = NULL;
+    for (size_t w = 0; w < MT_SLAB_MAP_WORDS; w++) {
+        size_t first = w * 64;
+        if (objects >= first + 64) region->slab_used[w] = 0;
+        else if (objects <= first) region->slab_used[w] = ~(uint64_t)0;
+        else region->slab_used[w] = ~(uint64_t)0 << (objects - first);
+    }
+}
+
+// Helper: Claim the first free object of a slab, NULL if it is full
+static void* mt_slab_take(MemRegion* region) {
+    for (size_t w = 0; w < MT_SLAB_MAP_WORDS; w++) {
+        uint64_t used = __atomic_load_n(&region->slab_used[w], __ATOMIC_RELAXED);
+        while (~used) {
+            int bit = __builtin_ctzll(~used);
+            if (__atomic_compare_exchange_n(&region->slab_used[w], &used,
+                                            used | ((uint64_t)1 << bit), true,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return (char*)region->start + (w * 64 + (size_t)bit) * region->slab_size;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Helper: Release a slab object; false if ptr is not an allocated object
+static bool mt_slab_release(MemRegion* region, void* ptr) {
+    size_t offset = (size_t)((char*)ptr - (char*)region->start);
+    // the tail past the last whole object has padding bits, not objects
+    if (offset % region->slab_size != 0 || offset + region->slab_size > region->total_size) return false;
+    size_t index = offset / region->slab_size;
+    uint64_t bit = (uint64_t)1 << (index % 64);
+    uint64_t old = __atomic_fetch_and(&region->slab_used[index / 64], ~bit, __ATOMIC_RELEASE);
+    return (old & bit) != 0;
+}
+
+// Helper: Check that ptr is an allocated object of a slab
+static bool mt_slab_owns(MemRegion* region, void* ptr) {
+    size_t offset = (size_t)((char*)ptr - (char*)region->start);
+    if (offset % region->slab_size != 0 || offset + region->slab_size > region->total_size) return false;
+    size_t index = offset / region->slab_size;
+    uint64_t used = __atomic_load_n(&region->slab_used[index / 64], __ATOMIC_RELAXED);
+    return (used >> (index % 64)) & 1;
+}
+
+// Helper: Allocate from the arena's slabs of one class, adding a slab when
+// all of them are full
+static void* mt_slab_alloc(MTArena* arena, size_t cls) {
+    MemRegion* hint = __atomic_load_n(&arena->slab_hint[cls], __ATOMIC_ACQUIRE);
+    if (hint) {
+        void* ptr = mt_slab_take(hint);
+        if (ptr) return ptr;
+    }
+    MemRegion* head = __atomic_load_n(&arena->slabs[cls], __ATOMIC_ACQUIRE);
+    for (MemRegion* region = head; region != NULL; region = region->arena_next) {
+        void* ptr = mt_slab_take(region);
+        if (ptr) {
+            __atomic_store_n(&arena->slab_hint[cls], region, __ATOMIC_RELEASE);
+            return ptr;
+        }
+    }
+    
+    pthread_mutex_lock(&arena->lock);
+    // Another thread of the arena may have added one meanwhile
+    if (__atomic_load_n(&arena->slabs[cls], __ATOMIC_ACQUIRE) != head) {
+        pthread_mutex_unlock(&arena->lock);
+        return mt_slab_alloc(arena, cls);
+    }
+    pthread_mutex_lock(&mt_global_lock);
+    MemRegion* slab = mt_create_extra_region(arena->index);
+    pthread_mutex_unlock(&mt_global_lock);
+    mt_make_slab(slab, (cls + 1) * MT_SLAB_STEP);
+    void* ptr = mt_slab_take(slab);
+    slab->arena_next = head;
+    __atomic_store_n(&arena->slabs[cls], slab, __ATOMIC_RELEASE);
+    __atomic_store_n(&arena->slab_hint[cls], slab, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&arena->lock);
+    return ptr;
+}
+
+// Helper: Free the blocks other arenas handed back (region lock held)
+static void mt_drain_remote_frees(MemRegion* region) {
+    if (!__atomic_load_n(&region->remote_frees, __ATOMIC_RELAXED)) return;
+    void* ptr = __atomic_exchange_n(&region->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (ptr) {
+        void* next = *(void**)ptr;
+        MTBlock* block = (MTBlock*)ptr - 1;
+        mt_block_set_flag(block, MT_BLOCK_CACHED, false);
+        mt_release_block(region, block);
+        ptr = next;
+    }
+}
+
+// Helper: Hand a block back to a region owned by another arena without
+// taking its lock; the owner frees it on its next allocation there
+static void mt_remote_free(MemRegion* region, MTBlock* block) {
+    void* ptr = mt_block_to_payload(block);
+    mt_block_set_flag(block, MT_BLOCK_CACHED, true);
+    void* head = __atomic_load_n(&region->remote_frees, __ATOMIC_RELAXED);
+    do {
+        *(void**)ptr = head;
+    } while (!__atomic_compare_exchange_n(&region->remote_frees, &head, ptr, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Helper: Lock a region, counting the times it had to wait
+static void mt_region_lock(MemRegion* region) {
+    if (pthread_mutex_trylock(&region->lock) != 0) {
+        pthread_mutex_lock(&region->lock);
+        region->lock_contended++;
+    }
+}
+
+// Helper: Best-fit allocation inside one region, NULL if nothing fits or,
+// unless `wait` is set, if another thread holds the region lock.
+// Only free blocks carry the zeroed bit; it is handed to the caller, with
+// the tree node and the footer word cleared.
+static void* mt_alloc_in_region(MemRegion* region, size_t need, bool* zeroed, bool wait) {
+    if (wait) mt_region_lock(region);
+    else if (pthread_mutex_trylock(&region->lock) != 0) return NULL;
+    mt_drain_remote_frees(region);
+    MTBlock* block = mt_find_best_fit(region, need);
+    if (block) {
+        mt_free_remove(region, block);
+        mt_mark_used(block);
+        mt_split_block_if_worth(region, block, need);
+        bool zero = mt_block_is(block, MT_BLOCK_ZEROED);
+        if (zero) {
+            memset(mt_tree_node_of(block), 0, sizeof(FreeTree));
+            *(size_t*)((char*)mt_next_block(block) - sizeof(size_t)) = 0;
+            mt_block_set_flag(block, MT_BLOCK_ZEROED, false);
+        }
+        if (zeroed) *zeroed = zero;
+    }
+    pthread_mutex_unlock(&region->lock);
+    return block ? mt_block_to_payload(block) : NULL;
+}
+
+// Helper: Return an allocated block to its region
+static void mt_region_free(MemRegion* region, MTBlock* block) {
+    mt_region_lock(region);
+    mt_release_block(region, block);
+    pthread_mutex_unlock(&region->lock);
+}
+
+// Helper: Give every cached block back to its region. Blocks cached before
+// the last heapKill belong to a heap that is gone and are just dropped.
+static void mt_tcache_flush(MTCache* cache) {
+    bool live = mt_initialized && cache->generation == mt_generation;
+    for (int c = 0; c < MT_TCACHE_CLASSES; c++) {
+        while (live && cache->heads[c]) {
+            void* ptr = cache->heads[c];
+            cache->heads[c] = *(void**)ptr;
+            MTBlock* block = (MTBlock*)ptr - 1;
+            mt_block_set_flag(block, MT_BLOCK_CACHED, false);
+            mt_region_free(mt_find_region_for_ptr(ptr), block);
+        }
+        cache->heads[c] = NULL;
+        cache->counts[c] = 0;
+    }
+}
+
+// Helper: Flush an exiting thread's cache for good. Blocks glibc frees
+// after the destructors have run go back to their regions: parked here,
+// nobody would ever flush them.
+static void mt_tcache_destructor(void* cache) {
+    mt_tcache_flush((MTCache*)cache);
+    ((MTCache*)cache)->dead = true;
+}
+
+static void mt_tcache_make_key(void) {
+    pthread_key_create(&mt_tcache_key, mt_tcache_destructor);
+}
+
+// Helper: Empty a cache whose blocks predate this heap
+static MTCache* mt_cache_current(MTCache* cache) {
+    if (cache->generation != mt_generation) {
+        memset(cache->heads, 0, sizeof(cache->heads));
+        memset(cache->counts, 0, sizeof(cache->counts));
+        cache->generation = mt_generation;
+    }
+    return cache;
+}
+
+// Helper: Get the calling thread's cache, emptied if it predates this heap
+static MTCache* mt_get_tcache(void) {
+    return mt_cache_current(&mt_tcache);
+}
+
+// Helper: Allocate the per-CPU caches on first use
+static MTCPUCache* mt_alloc_cpu_caches(void) {
+    pthread_mutex_lock(&mt_global_lock);
+    if (!mt_cpu_caches) {
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+        size_t count = cpus > 0 ? (size_t)cpus : 1;
+        void* mem = mmap(NULL, count * sizeof(MTCPUCache), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            printf("<mmap error>: out of memory\n");
+            exit(1);
+        }
+        MTCPUCache* caches = (MTCPUCache*)mem;
+        for (size_t i = 0; i < count; i++) {
+            pthread_mutex_init(&caches[i].lock, NULL);
+        }
+        mt_cpu_count = count;
+        __atomic_store_n(&mt_cpu_caches, caches, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&mt_global_lock);
+    return mt_cpu_caches;
+}
 
-    Block* nb = (Block*)mem;
-    nb->size = need_size;
-    nb->free = false;
-    nb->next = NULL;
+// Helper: Lock the cache of the CPU we are running on. Being migrated right
+// after sched_getcpu only costs a little locality, the lock keeps it safe.
+static MTCPUCache* mt_lock_cpu_cache(void) {
+    MTCPUCache* caches = __atomic_load_n(&mt_cpu_caches, __ATOMIC_ACQUIRE);
+    if (!caches) caches = mt_alloc_cpu_caches();
+    int cpu = sched_getcpu();
+    MTCPUCache* pc = &caches[(cpu < 0 ? 0 : (size_t)cpu) % mt_cpu_count];
+    pthread_mutex_lock(&pc->lock);
+    mt_cache_current(&pc->cache);
+    return pc;
+}
 
-    if (!blockList) {
-        blockList = nb;
-    } else {
-        Block* it = blockList;
-        while (it->next) it = it->next;
-        it->next = nb;
-    }
-    return block_to_payload(nb);
+// Helper: Push a block onto a cache, false if its class is full
+static bool mt_cache_push(MTCache* cache, MTBlock* block, size_t c) {
+    if (cache->counts[c] >= MT_TCACHE_DEPTH) return false;
+    void* ptr = mt_block_to_payload(block);
+    mt_block_set_flag(block, MT_BLOCK_CACHED, true);
+    *(void**)ptr = cache->heads[c];
+    cache->heads[c] = ptr;
+    cache->counts[c]++;
+    return true;
 }
 
-void customFree(void* ptr){
-    if (ptr == NULL){
-        printf ("<free error>: passed null pointer\n");
-        return;
-    }
-    init_heap_start_if_needed();
-    Block *cur_ptr = find_block_by_payload(ptr);
-    if (!cur_ptr){
-        printf("<free error>: passed non-heap pointer\n");
-        return;
-    }
-cur_ptr->free=true;
-coalesce_around(cur_ptr);
-try_shrink_heap();
+// Helper: Pop a block of class c from a cache, NULL if there is none
+static void* mt_cache_pop(MTCache* cache, size_t c) {
+    void* ptr = cache->heads[c];
+    if (!ptr) return NULL;
+    cache->heads[c] = *(void**)ptr;
+    cache->counts[c]--;
+    mt_block_set_flag((MTBlock*)ptr - 1, MT_BLOCK_CACHED, false);
+    return ptr;
 }
-void* customCalloc(size_t nmemb, size_t size){
-    if ( (nmemb == 0) || (size == 0)){
-        return NULL;
+
+// Helper: Park a block in the thread (or CPU) cache, false if it does not fit
+static bool mt_tcache_put(MTBlock* block) {
+    size_t size = mt_block_size(block);
+    if (size > MT_TCACHE_MAX_SIZE) {
+        return false;
     }
-    if (size != 0 && nmemb > (SIZE_MAX / size)) {
-        return NULL;
+    size_t c = size / MT_TCACHE_STEP - 1;
+    if (__atomic_load_n(&mt_percpu_cache, __ATOMIC_RELAXED)) {
+        MTCPUCache* pc = mt_lock_cpu_cache();
+        bool parked = mt_cache_push(&pc->cache, block, c);
+        pthread_mutex_unlock(&pc->lock);
+        return parked;
     }
-    size_t mul= nmemb*size;
-    void *ptr_call = customMalloc(mul);
-    if (ptr_call == NULL)return NULL;
-    memset (ptr_call,0,mul);
-    return ptr_call;
+    MTCache* cache = mt_get_tcache();
+    if (cache->dead || cache->counts[c] >= MT_TCACHE_DEPTH) return false;
+    if (!cache->registered) {
+        // set first: pthread_setspecific may allocate, and so come back here
+        cache->registered = true;
+        pthread_once(&mt_tcache_key_once, mt_tcache_make_key);
+        pthread_setspecific(mt_tcache_key, cache);
+    }
+    return mt_cache_push(cache, block, c);
 }
-void* customRealloc(void* ptr, size_t size) {
-    if (!ptr) {
-        ptr = customMalloc(size);
+
+// Helper: Take a block of exactly `need` bytes from the thread (or CPU) cache
+static void* mt_tcache_get(size_t need) {
+    size_t c = need / MT_TCACHE_STEP - 1;
+    if (__atomic_load_n(&mt_percpu_cache, __ATOMIC_RELAXED)) {
+        MTCPUCache* pc = mt_lock_cpu_cache();
+        void* ptr = mt_cache_pop(&pc->cache, c);
+        pthread_mutex_unlock(&pc->lock);
         return ptr;
     }
-    if (size == 0) {
-        customFree(ptr);
-        return NULL;
-    }
-    Block *new_block = find_block_by_payload(ptr);
-    if (!new_block) {
-        printf("<realloc error>: passed non-heap pointer\n");
-        return NULL;
+    return mt_cache_pop(mt_get_tcache(), c);
+}
+
+// Switch between thread and per-CPU caches. Blocks parked in the caches
+// being left are given back to their regions (for threads other than the
+// caller, thread caches are flushed when the thread exits).
+void heapSetPerCPUCache(bool enabled) {
+    if (enabled == __atomic_load_n(&mt_percpu_cache, __ATOMIC_RELAXED)) return;
+    __atomic_store_n(&mt_percpu_cache, enabled, __ATOMIC_RELAXED);
+    if (enabled) {
+        mt_tcache_flush(&mt_tcache);
+        return;
     }
-    size_t new_size = align4(size);
-    size_t old = new_block->size;
-    if (new_size <= old) {
-        if (new_size == old) return ptr;
-        split_block_if_worth(new_block, new_size);
-        if (new_block->size == new_size) return block_to_payload(new_block);
-        void *new_ptr = customMalloc(size);
-        if (!new_ptr)return NULL;
-        memcpy(new_ptr, ptr, size);
-        customFree(ptr);
-        return new_ptr;
+    MTCPUCache* caches = __atomic_load_n(&mt_cpu_caches, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; caches && i < mt_cpu_count; i++) {
+        // detach the lists, then free them without the cache lock: region
+        // locks are never taken while holding it
+        pthread_mutex_lock(&caches[i].lock);
+        MTCache detached = caches[i].cache;
+        memset(caches[i].cache.heads, 0, sizeof(caches[i].cache.heads));
+        memset(caches[i].cache.counts, 0, sizeof(caches[i].cache.counts));
+        pthread_mutex_unlock(&caches[i].lock);
+        mt_tcache_flush(&detached);
     }
-    void *new_ptr = customMalloc(size);
-    if (!new_ptr)return NULL;
-    memcpy(new_ptr, ptr, old);
-    customFree(ptr);
-    return new_ptr;
 }
 
-/*=============================================================================
-* Part B - Multi-threaded Memory Allocator Implementation
-=============================================================================*/
+// Helper: Fold an exiting thread's counters into the retired ones. The
+// counters stay registered but dead: glibc frees thread buffers after the
+// destructors have run, and linking them again would outlive the thread.
+static void mt_stats_destructor(void* arg) {
+    MTThreadStats* ts = (MTThreadStats*)arg;
+    pthread_mutex_lock(&mt_global_lock);
+    for (int c = 0; c < STATS_SIZE_CLASSES; c++) {
+        mt_stats_retired.allocs[c] += ts->allocs[c];
+        mt_stats_retired.frees[c] += ts->frees[c];
+    }
+    mt_stats_retired.in_use_bytes += ts->in_use_bytes;
+    mt_stats_retired.mapped_bytes += ts->mapped_bytes;
+    mt_stats_retired.mapped_blocks += ts->mapped_blocks;
+    MTThreadStats** link = &mt_stats_threads;
+    while (*link != ts) link = &(*link)->next;
+    *link = ts->next;
+    pthread_mutex_unlock(&mt_global_lock);
+    memset(ts, 0, sizeof(*ts));
+    ts->registered = true;
+    ts->dead = true;
+}
 
-// Global state for multi-threaded allocator
-static MemRegion* mt_regions = NULL;       // Array of initial regions
-static MemRegion* mt_extra_regions = NULL; // Linked list of dynamically added regions
-static int mt_next_region = 0;             // Index for round-robin allocation
-static pthread_mutex_t mt_global_lock = PTHREAD_MUTEX_INITIALIZER;
-static bool mt_initialized = false;
+static void mt_stats_make_key(void) {
+    pthread_key_create(&mt_stats_key, mt_stats_destructor);
+}
 
-// Helper: Align size to 4 bytes
-static size_t mt_align4(size_t x) {
-    if (x == 0) return 0;
-    return (size_t)ALIGN_TO_MULT_OF_4(x);
+// Helper: Add to one of this thread's counters; only this thread writes
+// it, so a relaxed store (no read-modify-write) is enough for readers
+static void mt_stat_add(size_t* counter, size_t delta) {
+    __atomic_store_n(counter, *counter + delta, __ATOMIC_RELAXED);
 }
 
-// Helper: Convert MTBlock to payload pointer
-static void* mt_block_to_payload(MTBlock* b) {
-    return (void*)(b + 1);
+// Helper: Add one allocation or free to a set of counters
+static void mt_stats_add_count(MTThreadStats* ts, size_t size, size_t mapping, bool alloc) {
+    size_t c = stats_class(size);
+    size_t sign = alloc ? 1 : (size_t)-1;
+    mt_stat_add(alloc ? &ts->allocs[c] : &ts->frees[c], 1);
+    mt_stat_add(&ts->in_use_bytes, sign * size);
+    if (mapping) {
+        mt_stat_add(&ts->mapped_bytes, sign * mapping);
+        mt_stat_add(&ts->mapped_blocks, sign);
+    }
 }
 
-// Helper: Find best fit block in a region
-static MTBlock* mt_find_best_fit(MemRegion* region, size_t need) {
-    MTBlock* best = NULL;
-    for (MTBlock* it = region->block_list; it != NULL; it = it->next) {
-        if (it->free && it->size >= need) {
-            if (!best || it->size < best->size) {
-                best = it;
-            }
-        }
+// Helper: Count an allocation or free of a block with `size` usable bytes;
+// `mapping` is the length of its own mapping, 0 for region blocks
+static void mt_stats_count(void* ptr, size_t size, size_t mapping, bool alloc) {
+    MTThreadStats* ts = &mt_tstats;
+    if (!ts->registered) {
+        // set first: pthread_setspecific may allocate, and so come back here
+        ts->registered = true;
+        pthread_once(&mt_stats_key_once, mt_stats_make_key);
+        pthread_setspecific(mt_stats_key, ts);
+        pthread_mutex_lock(&mt_global_lock);
+        ts->next = mt_stats_threads;
+        mt_stats_threads = ts;
+        pthread_mutex_unlock(&mt_global_lock);
     }
-    return best;
+    if (alloc) prof_alloc(ptr, size);
+    else prof_free(ptr);
+    if (ts->dead) {
+        // after the exit destructor: counted as an exited thread's
+        pthread_mutex_lock(&mt_global_lock);
+        mt_stats_add_count(&mt_stats_retired, size, mapping, alloc);
+        pthread_mutex_unlock(&mt_global_lock);
+        return;
+    }
+    mt_stats_add_count(ts, size, mapping, alloc);
 }
 
-// Helper: Split block if there's enough remaining space
-static void mt_split_block_if_worth(MTBlock* b, size_t need) {
-    if (!b) return;
-    const size_t MIN_REMAIN = sizeof(MTBlock) + 4;
-    if (b->size >= need + MIN_REMAIN) {
-        char* base = (char*)b;
-        MTBlock* newb = (MTBlock*)(base + sizeof(MTBlock) + need);
-        newb->size = b->size - need - sizeof(MTBlock);
-        newb->free = true;
-        newb->next = b->next;
-        b->size = need;
-        b->next = newb;
+// Helper: Usable bytes of a live payload of any kind; *mapping gets the
+// length of its own mapping, 0 for region blocks
+static size_t mt_usable_size(void* ptr, size_t* mapping) {
+    MemRegion* region = mt_find_region_for_ptr(ptr);
+    if (region && region != &mt_mmap_marker) {
+        *mapping = 0;
+        return region->slab_size ? region->slab_size : mt_block_size((MTBlock*)ptr - 1);
     }
+    Block* mb = (Block*)ptr - 1;
+    *mapping = mmap_chunk_length(mb);
+    return block_size(mb);
 }
 
-// Helper: Check if two blocks are adjacent in memory
-static int mt_are_adjacent(MTBlock* a, MTBlock* b) {
-    if (!a || !b) return 0;
-    char* end_a = (char*)a + sizeof(MTBlock) + a->size;
-    return end_a == (char*)b;
+// Helper: mt_stats_count for a live payload of any kind
+static void mt_stats_count_ptr(void* ptr, bool alloc) {
+    size_t mapping;
+    size_t size = mt_usable_size(ptr, &mapping);
+    mt_stats_count(ptr, size, mapping, alloc);
 }
 
-// Helper: Find previous block in list
-static MTBlock* mt_find_prev(MemRegion* region, MTBlock* target) {
-    if (!region->block_list || region->block_list == target) return NULL;
-    for (MTBlock* it = region->block_list; it && it->next; it = it->next) {
-        if (it->next == target) return it;
+size_t customMTUsableSize(void* ptr) {
+    size_t mapping;
+    return ptr && mt_initialized ? mt_usable_size(ptr, &mapping) : 0;
+}
+
+// Helper: Add one thread's counters to a total
+static void mt_stats_add_thread(AllocStats* stats, MTThreadStats* ts) {
+    for (int c = 0; c < STATS_SIZE_CLASSES; c++) {
+        size_t allocs = __atomic_load_n(&ts->allocs[c], __ATOMIC_RELAXED);
+        size_t frees = __atomic_load_n(&ts->frees[c], __ATOMIC_RELAXED);
+        stats->allocs[c] += allocs;
+        stats->frees[c] += frees;
+        stats->in_use_blocks += allocs - frees;
     }
-    return NULL;
+    stats->in_use_bytes += __atomic_load_n(&ts->in_use_bytes, __ATOMIC_RELAXED);
+    stats->mapped_bytes += __atomic_load_n(&ts->mapped_bytes, __ATOMIC_RELAXED);
+    stats->mapped_blocks += __atomic_load_n(&ts->mapped_blocks, __ATOMIC_RELAXED);
 }
 
-// Helper: Coalesce adjacent free blocks
-static void mt_coalesce_around(MemRegion* region, MTBlock* b) {
-    if (!b) return;
-    // Merge with next blocks
-    while (b->next && b->next->free && mt_are_adjacent(b, b->next)) {
-        MTBlock* nxt = b->next;
-        b->size += sizeof(MTBlock) + nxt->size;
-        b->next = nxt->next;
-    }
-    // Merge with previous block
-    MTBlock* prev = mt_find_prev(region, b);
-    if (prev && prev->free && mt_are_adjacent(prev, b)) {
-        prev->size += sizeof(MTBlock) + b->size;
-        prev->next = b->next;
-        b = prev;
-        while (b->next && b->next->free && mt_are_adjacent(b, b->next)) {
-            MTBlock* nxt = b->next;
-            b->size += sizeof(MTBlock) + nxt->size;
-            b->next = nxt->next;
-        }
+// Helper: Counter totals over all threads, past and present (global lock
+// held)
+static void mt_stats_sum(AllocStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    mt_stats_add_thread(stats, &mt_stats_retired);
+    for (MTThreadStats* ts = mt_stats_threads; ts != NULL; ts = ts->next) {
+        mt_stats_add_thread(stats, ts);
     }
 }
 
-// Helper: Find block by payload in a region
-static MTBlock* mt_find_block_by_payload(MemRegion* region, void* payload) {
-    for (MTBlock* it = region->block_list; it != NULL; it = it->next) {
-        if (mt_block_to_payload(it) == payload) {
-            return it;
+// Helper: Free space of one region
+static void mt_region_stats(MemRegion* region, MTRegionStats* out) {
+    out->start = region->start;
+    out->arena = region->arena;
+    out->slab_size = region->slab_size;
+    out->free_bytes = 0;
+    out->free_blocks = 0;
+    out->largest_free = 0;
+    if (region->slab_size) {
+        for (size_t w = 0; w < MT_SLAB_MAP_WORDS; w++) {
+            uint64_t used = __atomic_load_n(&region->slab_used[w], __ATOMIC_RELAXED);
+            out->free_blocks += (size_t)__builtin_popcountll(~used);
         }
+        out->free_bytes = out->free_blocks * region->slab_size;
+        out->largest_free = out->free_blocks ? region->slab_size : 0;
+        pthread_mutex_lock(&region->lock);
+        out->lock_contended = region->lock_contended;
+        pthread_mutex_unlock(&region->lock);
+        return;
     }
-    return NULL;
+    AllocStats tree = {0};
+    pthread_mutex_lock(&region->lock);
+    tree_stats(region->free_tree, &tree);
+    out->lock_contended = region->lock_contended;
+    pthread_mutex_unlock(&region->lock);
+    out->free_bytes = tree.free_bytes;
+    out->free_blocks = tree.free_blocks;
+    out->largest_free = tree.largest_free;
 }
 
-// Helper: Initialize a region with given memory
-static void mt_init_region(MemRegion* region, void* mem, size_t size) {
-    region->start = mem;
-    region->total_size = size;
-    pthread_mutex_init(&region->lock, NULL);
-    region->next = NULL;
-    
-    // Initialize with a single free block covering the whole region
-    MTBlock* initial_block = (MTBlock*)mem;
-    initial_block->size = size - sizeof(MTBlock);
-    initial_block->next = NULL;
-    initial_block->free = true;
-    region->block_list = initial_block;
+// Helper: Add one region's free space to a total
+static void mt_stats_add_region(AllocStats* stats, MemRegion* region) {
+    MTRegionStats rs;
+    mt_region_stats(region, &rs);
+    stats->free_bytes += rs.free_bytes;
+    stats->free_blocks += rs.free_blocks;
+    if (rs.largest_free > stats->largest_free) stats->largest_free = rs.largest_free;
+    stats->lock_contended += rs.lock_contended;
 }
 
-// Helper: Find which region contains a pointer
-static MemRegion* mt_find_region_for_ptr(void* ptr) {
-    // Check initial regions
-    for (int i = 0; i < MT_INITIAL_REGIONS; i++) {
-        MemRegion* region = &mt_regions[i];
-        char* start = (char*)region->start;
-        char* end = start + region->total_size;
-        if ((char*)ptr >= start && (char*)ptr < end) {
-            return region;
+size_t customMTRegionStats(MTRegionStats* out, size_t max) {
+    pthread_mutex_lock(&mt_global_lock);
+    size_t count = 0;
+    if (mt_initialized) {
+        for (int i = 0; i < MT_INITIAL_REGIONS; i++, count++) {
+            if (count < max) mt_region_stats(&mt_regions[i], &out[count]);
         }
-    }
-    // Check extra regions
-    for (MemRegion* region = mt_extra_regions; region != NULL; region = region->next) {
-        char* start = (char*)region->start;
-        char* end = start + region->total_size;
-        if ((char*)ptr >= start && (char*)ptr < end) {
-            return region;
+        for (MemRegion* region = mt_extra_regions; region != NULL; region = region->next, count++) {
+            if (count < max) mt_region_stats(region, &out[count]);
         }
     }
-    return NULL;
+    pthread_mutex_unlock(&mt_global_lock);
+    return count;
 }
 
-// Helper: Create a new extra region
-static MemRegion* mt_create_extra_region(void) {
-    // Allocate memory for region structure using sbrk
-    void* region_mem = sbrk(sizeof(MemRegion));
-    if (region_mem == SBRK_FAIL) {
-        printf("<sbrk/brk error>: out of memory\n");
-        exit(1);
+AllocStats customMTMallocStats(void) {
+    AllocStats stats;
+    pthread_mutex_lock(&mt_global_lock);
+    mt_stats_sum(&stats);
+    for (int c = 0; c < STATS_SIZE_CLASSES; c++) {
+        stats.allocs[c] -= mt_stats_base.allocs[c];
+        stats.frees[c] -= mt_stats_base.frees[c];
     }
-    MemRegion* new_region = (MemRegion*)region_mem;
+    stats.in_use_bytes -= mt_stats_base.in_use_bytes;
+    stats.in_use_blocks -= mt_stats_base.in_use_blocks;
+    stats.mapped_bytes -= mt_stats_base.mapped_bytes;
+    stats.mapped_blocks -= mt_stats_base.mapped_blocks;
     
-    // Allocate memory for the region's heap space
-    void* heap_mem = sbrk(MT_REGION_SIZE);
-    if (heap_mem == SBRK_FAIL) {
-        printf("<sbrk/brk error>: out of memory\n");
-        exit(1);
+    size_t regions = 0;
+    if (mt_initialized) {
+        for (int i = 0; i < MT_INITIAL_REGIONS; i++, regions++) {
+            mt_stats_add_region(&stats, &mt_regions[i]);
+        }
+        for (MemRegion* region = mt_extra_regions; region != NULL; region = region->next, regions++) {
+            mt_stats_add_region(&stats, region);
+        }
     }
-    
-    mt_init_region(new_region, heap_mem, MT_REGION_SIZE);
-    
-    // Add to extra regions list
-    new_region->next = mt_extra_regions;
-    mt_extra_regions = new_region;
-    
-    return new_region;
+    stats.heap_bytes = regions * MT_REGION_SIZE;
+    pthread_mutex_unlock(&mt_global_lock);
+    return stats;
 }
 
 // Initialize the multi-threaded heap
@@ -388,25 +1919,30 @@ void heapCreate() {
         return;
     }
     
-    // Allocate memory for region structures
-    void* regions_mem = sbrk(MT_INITIAL_REGIONS * sizeof(MemRegion));
-    if (regions_mem == SBRK_FAIL) {
-        printf("<sbrk/brk error>: out of memory\n");
-        exit(1);
-    }
-    mt_regions = (MemRegion*)regions_mem;
+    // Allocate memory for region structures, on cache lines of their own
+    mt_regions = (MemRegion*)mt_sbrk_aligned(MT_INITIAL_REGIONS * sizeof(MemRegion),
+                                             MT_CACHE_LINE);
+    if (!page_size) page_size = (size_t)sysconf(_SC_PAGESIZE);
     
     // Allocate and initialize each region
+    char* regions_heap = (char*)mt_sbrk_aligned(MT_INITIAL_REGIONS * MT_REGION_SIZE,
+                                                 MT_REGION_SIZE);
     for (int i = 0; i < MT_INITIAL_REGIONS; i++) {
-        void* region_heap = sbrk(MT_REGION_SIZE);
-        if (region_heap == SBRK_FAIL) {
-            printf("<sbrk/brk error>: out of memory\n");
-            exit(1);
-        }
-        mt_init_region(&mt_regions[i], region_heap, MT_REGION_SIZE);
+        mt_init_region(&mt_regions[i], regions_heap + i * MT_REGION_SIZE, MT_REGION_SIZE,
+                       i % MT_ARENAS);
+        mt_map_set(mt_regions[i].start, &mt_regions[i]);
     }
     
-    mt_next_region = 0;
+    for (int a = 0; a < MT_ARENAS; a++) {
+        pthread_mutex_init(&mt_arenas[a].lock, NULL);
+        mt_arenas[a].index = a;
+        mt_arenas[a].next_region = 0;
+        mt_arenas[a].extra_regions = NULL;
+        for (int c = 0; c < MT_SLAB_CLASSES; c++) {
+            mt_arenas[a].slabs[c] = NULL;
+            mt_arenas[a].slab_hint[c] = NULL;
+        }
+    }
     mt_initialized = true;
     
     pthread_mutex_unlock(&mt_global_lock);
@@ -414,6 +1950,9 @@ void heapCreate() {
 
 // Destroy the multi-threaded heap
 void heapKill() {
+    // Other threads' caches are dropped lazily through the generation
+    mt_tcache_flush(&mt_tcache);
+    
     pthread_mutex_lock(&mt_global_lock);
     
     if (!mt_initialized) {
@@ -423,114 +1962,189 @@ void heapKill() {
     
     // Destroy mutexes for initial regions
     for (int i = 0; i < MT_INITIAL_REGIONS; i++) {
+        mt_map_set(mt_regions[i].start, NULL);
         pthread_mutex_destroy(&mt_regions[i].lock);
     }
     
     // Destroy mutexes for extra regions
     for (MemRegion* region = mt_extra_regions; region != NULL; region = region->next) {
+        mt_map_set(region->start, NULL);
         pthread_mutex_destroy(&region->lock);
     }
     
-    // Reset state (memory will be reclaimed when process exits)
+    for (int a = 0; a < MT_ARENAS; a++) {
+        pthread_mutex_destroy(&mt_arenas[a].lock);
+    }
+    
+    // Reset state (memory will be reclaimed when process exits); the
+    // counters start over from here
+    mt_stats_sum(&mt_stats_base);
     mt_regions = NULL;
     mt_extra_regions = NULL;
-    mt_next_region = 0;
+    mt_struct_pool_left = 0;
+    mt_generation++;
     mt_initialized = false;
     
     pthread_mutex_unlock(&mt_global_lock);
 }
 
-// Multi-threaded malloc
-void* customMTMalloc(size_t size) {
-    if (size == 0) return NULL;
-    if (!mt_initialized) return NULL;
-    
-    size_t need_size = mt_align4(size);
-    
-    // Need space for block header too
-    size_t total_need = need_size;
-    
-    // Check this won't exceed region size
-    if (total_need + sizeof(MTBlock) > MT_REGION_SIZE) {
-        // Cannot allocate more than region size
-        return NULL;
-    }
-    
+// fork() handlers. Locks are taken in the order the allocator nests them:
+// arena, global, region; the per-CPU cache locks are never held while
+// taking another.
+static bool mt_fork_arenas;                // heapForkPrepare locked the arenas
+static bool mt_fork_regions;               // and the regions
+
+void heapForkPrepare(void) {
+    pthread_mutex_lock(&trace_lock);
+    pthread_mutex_lock(&prof_lock);
+    mt_fork_arenas = mt_initialized;
+    for (int a = 0; mt_fork_arenas && a < MT_ARENAS; a++) pthread_mutex_lock(&mt_arenas[a].lock);
     pthread_mutex_lock(&mt_global_lock);
-    
-    int start_region = mt_next_region;
-    int regions_checked = 0;
-    int total_regions = MT_INITIAL_REGIONS;
-    
-    // Count extra regions
-    for (MemRegion* r = mt_extra_regions; r != NULL; r = r->next) {
-        total_regions++;
+    mt_fork_regions = mt_initialized;
+    if (mt_fork_regions) {
+        for (int i = 0; i < MT_INITIAL_REGIONS; i++) pthread_mutex_lock(&mt_regions[i].lock);
+        for (MemRegion* region = mt_extra_regions; region != NULL; region = region->next) {
+            pthread_mutex_lock(&region->lock);
+        }
     }
-    
-    // Try to find a region with enough space using round-robin
-    while (regions_checked < MT_INITIAL_REGIONS) {
-        int region_idx = (start_region + regions_checked) % MT_INITIAL_REGIONS;
-        MemRegion* region = &mt_regions[region_idx];
-        
-        pthread_mutex_lock(&region->lock);
-        
-        MTBlock* block = mt_find_best_fit(region, need_size);
-        if (block) {
-            block->free = false;
-            mt_split_block_if_worth(block, need_size);
-            
-            // Update next region for round-robin
-            mt_next_region = (region_idx + 1) % MT_INITIAL_REGIONS;
-            
-            pthread_mutex_unlock(&region->lock);
-            pthread_mutex_unlock(&mt_global_lock);
-            return mt_block_to_payload(block);
+    for (size_t i = 0; mt_cpu_caches && i < mt_cpu_count; i++) pthread_mutex_lock(&mt_cpu_caches[i].lock);
+}
+
+// Helper: Unlock a lock taken by heapForkPrepare; in the child it is made
+// anew instead, as glibc does with its own malloc locks
+static void mt_fork_unlock(pthread_mutex_t* lock, bool child) {
+    if (child) pthread_mutex_init(lock, NULL);
+    else pthread_mutex_unlock(lock);
+}
+
+// Helper: Release everything heapForkPrepare locked
+static void mt_fork_release(bool child) {
+    for (size_t i = 0; mt_cpu_caches && i < mt_cpu_count; i++) mt_fork_unlock(&mt_cpu_caches[i].lock, child);
+    if (mt_fork_regions) {
+        for (int i = 0; i < MT_INITIAL_REGIONS; i++) mt_fork_unlock(&mt_regions[i].lock, child);
+        for (MemRegion* region = mt_extra_regions; region != NULL; region = region->next) {
+            mt_fork_unlock(&region->lock, child);
+        }
+    }
+    mt_fork_unlock(&mt_global_lock, child);
+    for (int a = 0; mt_fork_arenas && a < MT_ARENAS; a++) mt_fork_unlock(&mt_arenas[a].lock, child);
+    mt_fork_unlock(&prof_lock, child);
+    mt_fork_unlock(&trace_lock, child);
+}
+
+void heapForkParent(void) {
+    mt_fork_release(false);
+}
+
+void heapForkChild(void) {
+    // the parent's records stay the parent's
+    if (trace_fd >= 0) {
+        close(trace_fd);
+        trace_used = 0;
+        __atomic_store_n(&trace_fd, -1, __ATOMIC_RELAXED);
+        trace_forget_all();
+    }
+    mt_fork_release(true);
+}
+
+// Helper: Allocate a block of `need` bytes from the home arena's regions,
+// adding a region when none of them has space
+static void* mt_arena_alloc(size_t need_size, bool* zeroed) {
+    // Only the home arena is searched, so threads with different arenas
+    // never wait on each other. Each call starts one initial region further
+    // (round-robin); the first pass skips regions whose lock is taken, only
+    // the second one waits for them.
+    MTArena* arena = mt_get_home_arena();
+    unsigned first = __atomic_fetch_add(&arena->next_region, 1, __ATOMIC_RELAXED);
+    MemRegion* extra = __atomic_load_n(&arena->extra_regions, __ATOMIC_ACQUIRE);
+    for (int pass = 0; pass < 2; pass++) {
+        bool wait = pass == 1;
+        for (int i = 0; i < MT_REGIONS_PER_ARENA; i++) {
+            int slot = (int)((first + (unsigned)i) % MT_REGIONS_PER_ARENA);
+            MemRegion* region = &mt_regions[arena->index + slot * MT_ARENAS];
+            void* ptr = mt_alloc_in_region(region, need_size, zeroed, wait);
+            if (ptr) return ptr;
+        }
+        for (MemRegion* region = extra; region != NULL; region = region->arena_next) {
+            void* ptr = mt_alloc_in_region(region, need_size, zeroed, wait);
+            if (ptr) return ptr;
         }
-        
-        pthread_mutex_unlock(&region->lock);
-        regions_checked++;
     }
     
-    // Check extra regions
-    for (MemRegion* region = mt_extra_regions; region != NULL; region = region->next) {
-        pthread_mutex_lock(&region->lock);
-        
-        MTBlock* block = mt_find_best_fit(region, need_size);
-        if (block) {
-            block->free = false;
-            mt_split_block_if_worth(block, need_size);
-            
-            pthread_mutex_unlock(&region->lock);
-            pthread_mutex_unlock(&mt_global_lock);
-            return mt_block_to_payload(block);
+    // No region of the arena has space. The arena lock only serialises
+    // growth: regions another thread added meanwhile are tried first.
+    pthread_mutex_lock(&arena->lock);
+    for (MemRegion* region = arena->extra_regions; region != extra; region = region->arena_next) {
+        void* ptr = mt_alloc_in_region(region, need_size, zeroed, true);
+        if (ptr) {
+            pthread_mutex_unlock(&arena->lock);
+            return ptr;
         }
-        
-        pthread_mutex_unlock(&region->lock);
     }
     
-    // No existing region has space, create a new one
-    MemRegion* new_region = mt_create_extra_region();
+    // The global lock only guards sbrk and the global region list
+    pthread_mutex_lock(&mt_global_lock);
+    MemRegion* new_region = mt_create_extra_region(arena->index);
+    pthread_mutex_unlock(&mt_global_lock);
+    
+    void* ptr = mt_alloc_in_region(new_region, need_size, zeroed, true);
+    new_region->arena_next = arena->extra_regions;
+    __atomic_store_n(&arena->extra_regions, new_region, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&arena->lock);
+    return ptr;
+}
+
+// Helper: customMTMalloc, also telling whether the memory is known zero, its
+// usable size and the length of its own mapping (0 for region memory)
+static void* mt_malloc(size_t size, bool* zeroed, size_t* usable, size_t* mapping) {
+    if (zeroed) *zeroed = false;
+    *mapping = 0;
+    if (size == 0) return NULL;
+    if (!mt_initialized) return NULL;
+    
+    size_t need_size = mt_payload_for(size);
     
-    pthread_mutex_lock(&new_region->lock);
+    // Large requests, and anything that cannot fit in a region, get their
+    // own mapping
+    if (size >= mmap_threshold || need_size > MT_REGION_MAX_PAYLOAD) {
+        Block* mb = mmap_chunk_alloc(size, ALIGNMENT, MT_BLOCK_MAGIC);
+        if (mb == NULL) return NULL;
+        if (zeroed) *zeroed = true;
+        *usable = block_size(mb);
+        *mapping = mmap_chunk_length(mb);
+        return block_to_payload(mb);
+    }
     
-    MTBlock* block = mt_find_best_fit(new_region, need_size);
-    if (block) {
-        block->free = false;
-        mt_split_block_if_worth(block, need_size);
-        
-        pthread_mutex_unlock(&new_region->lock);
-        pthread_mutex_unlock(&mt_global_lock);
-        return mt_block_to_payload(block);
+    // Small objects come from a slab of their size class
+    if (size <= MT_SLAB_MAX_SIZE) {
+        size_t cls = (size - 1) / MT_SLAB_STEP;
+        *usable = (cls + 1) * MT_SLAB_STEP;
+        return mt_slab_alloc(mt_get_home_arena(), cls);
     }
     
-    pthread_mutex_unlock(&new_region->lock);
-    pthread_mutex_unlock(&mt_global_lock);
+    // A recently freed block of the same size needs no lock at all
+    if (need_size <= MT_TCACHE_MAX_SIZE) {
+        void* cached = mt_tcache_get(need_size);
+        if (cached) {
+            *usable = need_size;
+            return cached;
+        }
+    }
     
-    return NULL;
+    void* ptr = mt_arena_alloc(need_size, zeroed);
+    if (ptr) *usable = mt_block_size((MTBlock*)ptr - 1);
+    return ptr;
+}
+// Multi-threaded malloc
+static void* mt_api_malloc(size_t size) {
+    size_t usable, mapping;
+    void* ptr = mt_malloc(size, NULL, &usable, &mapping);
+    if (ptr) mt_stats_count(ptr, usable, mapping, true);
+    return ptr;
 }
 
 // Multi-threaded free
-void customMTFree(void* ptr) {
+static void mt_api_free(void* ptr) {
     if (ptr == NULL) {
         printf("<free error>: passed null pointer\n");
         return;
@@ -543,28 +2157,97 @@ void customMTFree(void* ptr) {
     
     // Find which region this pointer belongs to
     MemRegion* region = mt_find_region_for_ptr(ptr);
-    if (!region) {
+    if (!region || region == &mt_mmap_marker) {
+        Block* mb = mt_mapped_lookup(ptr, region);
+        if (mb) {
+            mt_stats_count(ptr, block_size(mb), mmap_chunk_length(mb), false);
+            mt_mapped_free(mb);
+            return;
+        }
         printf("<free error>: passed non-heap pointer\n");
         return;
     }
     
-    pthread_mutex_lock(&region->lock);
+    if (region->slab_size) {
+        if (!mt_slab_release(region, ptr)) {
+            printf("<free error>: passed non-heap pointer\n");
+            return;
+        }
+        mt_stats_count(ptr, region->slab_size, 0, false);
+        return;
+    }
     
+    // The header is validated without the region lock: only the owner of
+    // an allocated block touches its header
     MTBlock* block = mt_find_block_by_payload(region, ptr);
-    if (!block) {
-        pthread_mutex_unlock(&region->lock);
+    if (!block || mt_block_is(block, BLOCK_FREE | MT_BLOCK_CACHED)) {
         printf("<free error>: passed non-heap pointer\n");
         return;
     }
     
-    block->free = true;
-    mt_coalesce_around(region, block);
+    mt_stats_count(ptr, mt_block_size(block), 0, false);
+    if (mt_tcache_put(block)) return;
+    if (region->arena != mt_get_home_arena()->index) {
+        mt_remote_free(region, block);
+        return;
+    }
+    mt_region_free(region, block);
+}
+
+// Multi-threaded aligned malloc
+static void* mt_api_aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) return NULL;
+    if (alignment <= ALIGNMENT) return customMTMalloc(size);
+    if (size == 0) return NULL;
+    if (!mt_initialized) return NULL;
+    if (!page_size) page_size = (size_t)sysconf(_SC_PAGESIZE);
+    if (alignment > page_size) return NULL;
+    
+    size_t need_size = mt_payload_for(size);
+    
+    // Room for the aligned block plus a free block in front of it
+    const size_t MIN_GAP = sizeof(MTBlock) + MT_MIN_PAYLOAD;
+    size_t total_need = need_size + alignment + MIN_GAP;
+    
+    if (total_need >= mmap_threshold || total_need > MT_REGION_MAX_PAYLOAD) {
+        Block* mb = mmap_chunk_alloc(size, alignment, MT_BLOCK_MAGIC);
+        if (!mb) return NULL;
+        void* payload = block_to_payload(mb);
+        if (alignment == page_size) {
+            pthread_mutex_lock(&mt_global_lock);
+            mt_map_set(payload, &mt_mmap_marker);
+            pthread_mutex_unlock(&mt_global_lock);
+        }
+        mt_stats_count(payload, block_size(mb), mmap_chunk_length(mb), true);
+        return payload;
+    }
+    
+    // Over-allocate from a region, then split the misaligned front off as a
+    // free block of its own
+    size_t usable, mapping;
+    void* ptr = mt_malloc(total_need, NULL, &usable, &mapping);
+    if (!ptr) return NULL;
+    MemRegion* region = mt_find_region_for_ptr(ptr);
+    MTBlock* block = (MTBlock*)ptr - 1;
+    char* aligned = (char*)(((uintptr_t)ptr + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    if (aligned != (char*)ptr && (size_t)(aligned - (char*)ptr) < MIN_GAP) aligned += alignment;
     
+    mt_region_lock(region);
+    if (aligned != (char*)ptr) {
+        MTBlock* ab = (MTBlock*)aligned - 1;
+        mt_block_stamp(ab, (size_t)((char*)ptr + mt_block_size(block) - aligned), 0);
+        mt_block_set_size(block, (size_t)((char*)ab - (char*)ptr));
+        mt_release_block(region, block);
+        block = ab;
+    }
+    mt_split_block_if_worth(region, block, need_size);
     pthread_mutex_unlock(&region->lock);
+    mt_stats_count(mt_block_to_payload(block), mt_block_size(block), 0, true);
+    return mt_block_to_payload(block);
 }
 
 // Multi-threaded calloc
-void* customMTCalloc(size_t nmemb, size_t size) {
+static void* mt_api_calloc(size_t nmemb, size_t size) {
     if (nmemb == 0 || size == 0) {
         return NULL;
     }
@@ -575,15 +2258,19 @@ void* customMTCalloc(size_t nmemb, size_t size) {
     }
     
     size_t total_size = nmemb * size;
-    void* ptr = customMTMalloc(total_size);
+    bool zeroed;
+    size_t usable, mapping;
+    void* ptr = mt_malloc(total_size, &zeroed, &usable, &mapping);
     if (ptr == NULL) return NULL;
+    mt_stats_count(ptr, usable, mapping, true);
     
-    memset(ptr, 0, total_size);
+    // Fresh region memory and mappings come zeroed from the kernel
+    if (!zeroed) memset(ptr, 0, total_size);
     return ptr;
 }
 
 // Multi-threaded realloc
-void* customMTRealloc(void* ptr, size_t size) {
+static void* mt_api_realloc(void* ptr, size_t size) {
     // If ptr is NULL, equivalent to malloc
     if (!ptr) {
         return customMTMalloc(size);
@@ -602,22 +2289,54 @@ void* customMTRealloc(void* ptr, size_t size) {
     
     // Find which region this pointer belongs to
     MemRegion* region = mt_find_region_for_ptr(ptr);
-    if (!region) {
+    if (!region || region == &mt_mmap_marker) {
+        Block* mb = mt_mapped_lookup(ptr, region);
+        if (mb) {
+            // stay in a mapping while customMTMalloc would pick one
+            if (size >= mmap_threshold || mt_payload_for(size) > MT_REGION_MAX_PAYLOAD) {
+                // counted as freed first: once remapped, the old address
+                // can be handed out again
+                mt_stats_count(ptr, block_size(mb), mmap_chunk_length(mb), false);
+                void* new_ptr = mt_mapped_resize(mb, size);
+                mt_stats_count_ptr(new_ptr ? new_ptr : ptr, true);
+                return new_ptr;
+            }
+            void* new_ptr = customMTMalloc(size);
+            if (!new_ptr) return NULL;
+            memcpy(new_ptr, ptr, size < block_size(mb) ? size : block_size(mb));
+            mt_stats_count(ptr, block_size(mb), mmap_chunk_length(mb), false);
+            mt_mapped_free(mb);
+            return new_ptr;
+        }
         printf("<realloc error>: passed non-heap pointer\n");
         return NULL;
     }
     
-    pthread_mutex_lock(&region->lock);
+    if (region->slab_size) {
+        if (!mt_slab_owns(region, ptr)) {
+            printf("<realloc error>: passed non-heap pointer\n");
+            return NULL;
+        }
+        if (size <= region->slab_size) return ptr;
+        void* new_ptr = customMTMalloc(size);
+        if (!new_ptr) return NULL;
+        memcpy(new_ptr, ptr, region->slab_size);
+        mt_slab_release(region, ptr);
+        mt_stats_count(ptr, region->slab_size, 0, false);
+        return new_ptr;
+    }
+    
+    mt_region_lock(region);
     
     MTBlock* block = mt_find_block_by_payload(region, ptr);
-    if (!block) {
+    if (!block || mt_block_is(block, BLOCK_FREE | MT_BLOCK_CACHED)) {
         pthread_mutex_unlock(&region->lock);
         printf("<realloc error>: passed non-heap pointer\n");
         return NULL;
     }
     
-    size_t old_size = block->size;
-    size_t new_size = mt_align4(size);
+    size_t old_size = mt_block_size(block);
+    size_t new_size = mt_payload_for(size);
     
     // If new size fits in current block
     if (new_size <= old_size) {
@@ -626,9 +2345,11 @@ void* customMTRealloc(void* ptr, size_t size) {
             return ptr;
         }
         
-        mt_split_block_if_worth(block, new_size);
-        if (block->size == new_size) {
+        mt_split_block_if_worth(region, block, new_size);
+        if (mt_block_size(block) == new_size) {
             pthread_mutex_unlock(&region->lock);
+            mt_stats_count(ptr, old_size, 0, false);
+            mt_stats_count(ptr, new_size, 0, true);
             return mt_block_to_payload(block);
         }
         
@@ -643,6 +2364,22 @@ void* customMTRealloc(void* ptr, size_t size) {
         return new_ptr;
     }
     
+    // Grow into the free block right after this one if it is big enough
+    mt_drain_remote_frees(region);
+    MTBlock* nxt = mt_next_block(block);
+    if (mt_block_is(nxt, BLOCK_FREE) &&
+        old_size + sizeof(MTBlock) + mt_block_size(nxt) >= new_size) {
+        mt_free_remove(region, nxt);
+        mt_block_set_size(block, old_size + sizeof(MTBlock) + mt_block_size(nxt));
+        mt_set_head(nxt, 0);
+        mt_block_set_flag(mt_next_block(block), BLOCK_PREV_FREE, false);
+        mt_split_block_if_worth(region, block, new_size);
+        pthread_mutex_unlock(&region->lock);
+        mt_stats_count(ptr, old_size, 0, false);
+        mt_stats_count(ptr, mt_block_size(block), 0, true);
+        return ptr;
+    }
+    
     pthread_mutex_unlock(&region->lock);
     
     // Need more space, allocate new block
@@ -653,3 +2390,35 @@ void* customMTRealloc(void* ptr, size_t size) {
     customMTFree(ptr);
     return new_ptr;
 }
+
+// The public Part B calls, recording into the open trace
+void* customMTMalloc(size_t size) {
+    if (!trace_wanted()) return mt_api_malloc(size);
+    trace_begin(NULL);
+    return trace_end(TRACE_MALLOC | TRACE_MT, 0, NULL, mt_api_malloc(size), size, 0);
+}
+void* customMTAlignedAlloc(size_t alignment, size_t size) {
+    if (!trace_wanted()) return mt_api_aligned_alloc(alignment, size);
+    trace_begin(NULL);
+    return trace_end(TRACE_ALIGNED | TRACE_MT, 0, NULL, mt_api_aligned_alloc(alignment, size),
+                     size, alignment);
+}
+void customMTFree(void* ptr) {
+    if (!trace_wanted()) {
+        mt_api_free(ptr);
+        return;
+    }
+    uint32_t id = trace_begin(ptr);
+    mt_api_free(ptr);
+    trace_end(TRACE_FREE | TRACE_MT, id, ptr, NULL, 0, 0);
+}
+void* customMTCalloc(size_t nmemb, size_t size) {
+    if (!trace_wanted()) return mt_api_calloc(nmemb, size);
+    trace_begin(NULL);
+    return trace_end(TRACE_CALLOC | TRACE_MT, 0, NULL, mt_api_calloc(nmemb, size), nmemb * size, 0);
+}
+void* customMTRealloc(void* ptr, size_t size) {
+    if (!trace_wanted()) return mt_api_realloc(ptr, size);
+    uint32_t id = trace_begin(ptr);
+    return trace_end(TRACE_REALLOC | TRACE_MT, id, ptr, mt_api_realloc(ptr, size), size, 0);
+}
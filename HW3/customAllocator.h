@@ -29,20 +29,87 @@ void heapKill();
 /*=============================================================================
 * defines
 =============================================================================*/
+#include <stdint.h>
+
 #define SBRK_FAIL (void*)(-1)
+#define BLOCK_MAGIC 0xB10CA11Cu    // seeds the address tag of Part A headers
 #define ALIGN_TO_MULT_OF_4(x) (((((x) - 1) >> 2) << 2) + 4)
+#define ALIGNMENT 16               // alignof(max_align_t) on x86-64
+#define ALIGN_TO_MULT_OF_16(x) (((((x) - 1) >> 4) << 4) + 16)
 
 /*=============================================================================
 * Block
 =============================================================================*/
-//suggestion for block usage - feel free to change this
+// Blocks are laid out back to back; the next block starts right after the
+// payload. The header is a single word: the span from this header to the
+// next one (a multiple of ALIGNMENT, so payload sizes are 8 more than one),
+// four flag bits below it and a tag derived from the header's address above
+// it, which is how free/realloc recognise a real header. A free block
+// repeats its payload size in the last word of its payload (boundary tag)
+// and the block after it has BLOCK_PREV_FREE set, so both neighbours are
+// reachable in O(1). Allocated blocks carry nothing but the header. Every
+// heap segment ends with an in-use fence block of span 0.
 typedef struct Block
 {
-    size_t size;
-    struct Block* next;
-    bool free;
+    size_t head;                   // tag | span | flags, 0 on fences
 } Block;
-extern Block* blockList;
+extern Block* blockList;           // first block of the heap
+
+#define BLOCK_FREE ((size_t)1)
+#define BLOCK_PREV_FREE ((size_t)2)  // the block right before this one is free
+#define BLOCK_MMAPPED ((size_t)4)    // lives in its own mapping, see below
+#define BLOCK_FLAGS ((size_t)15)
+#define BLOCK_TAG_SHIFT 48
+#define BLOCK_SPAN_MASK ((((size_t)1) << BLOCK_TAG_SHIFT) - 1 - BLOCK_FLAGS)
+
+/*=============================================================================
+* Part A - segregated free lists
+=============================================================================*/
+// Free blocks keep their bin links at the start of the (unused) payload and
+// the size footer at its end, so every block payload must hold both.
+typedef struct FreeLinks
+{
+    Block* prev;
+    Block* next;
+} FreeLinks;
+
+// Free blocks too big for an exact bin (and all free blocks of a Part B
+// region) are nodes of a treap ordered by size, then address. The node
+// takes the place of the bin links; its priority is a hash of its address.
+typedef struct FreeTree
+{
+    struct FreeTree* left;
+    struct FreeTree* right;
+} FreeTree;
+
+#define MIN_PAYLOAD (sizeof(FreeLinks) + sizeof(size_t))
+#define SMALL_BIN_LIMIT 512        // sizes below this get an exact-size bin
+#define SMALL_BIN_STEP ALIGNMENT   // distance between two exact-size bins
+#define NUM_SMALL_BINS ((SMALL_BIN_LIMIT - MIN_PAYLOAD + SMALL_BIN_STEP - 1) / SMALL_BIN_STEP)
+#define NUM_BINS NUM_SMALL_BINS    // larger sizes live in the free tree
+#define BINMAP_WORDS ((NUM_BINS + 63) / 64)
+
+/*=============================================================================
+* Part A - tuning
+=============================================================================*/
+#define DEFAULT_TRIM_THRESHOLD (128 * 1024)
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
+
+// The program break is only lowered once the free block at the top of the
+// heap reaches this many bytes (like glibc's M_TRIM_THRESHOLD); 0 releases
+// every free byte at the top right away.
+void heapSetTrimThreshold(size_t bytes);
+
+// Requests of at least this many bytes get a private anonymous mapping
+// (Block header in the first page, right before the payload) which is
+// unmapped again on free, in both allocators. Part B requests that cannot
+// fit in a region are always mapped.
+void heapSetMmapThreshold(size_t bytes);
+
+// Aligned allocation for alignments above ALIGNMENT (e.g. 64 for a cache
+// line or the page size). alignment must be a power of two; the result is
+// released with customFree.
+void* customAlignedAlloc(size_t alignment, size_t size);
 
 /*=============================================================================
 * Part B - Multi-threaded allocator definitions
@@ -50,24 +117,250 @@ extern Block* blockList;
 #include <pthread.h>
 
 #define MT_REGION_SIZE 4096        // 4KB per region
+#define MT_REGION_SHIFT 12         // log2(MT_REGION_SIZE), regions are aligned to it
 #define MT_INITIAL_REGIONS 8       // 8 initial regions
+#define MT_ARENAS 4                // home region groups threads are spread over
+#define MT_REGIONS_PER_ARENA (MT_INITIAL_REGIONS / MT_ARENAS)
+#define MT_CACHE_LINE 64           // Shared metadata is aligned and padded to this
+#define MT_MIN_PAYLOAD MIN_PAYLOAD // Room for a free tree node and a footer
 
-// Block structure for multi-threaded allocator (within regions)
+// Slabs: requests of up to MT_SLAB_MAX_SIZE bytes are served from regions
+// dedicated to one size class. Objects carry no header; an occupancy bitmap
+// in the MemRegion is updated with atomic bit operations, so slab
+// allocation and free take no region lock.
+#define MT_SLAB_STEP 16
+#define MT_SLAB_MAX_SIZE 64
+#define MT_SLAB_CLASSES (MT_SLAB_MAX_SIZE / MT_SLAB_STEP)
+#define MT_SLAB_MAP_WORDS (MT_REGION_SIZE / MT_SLAB_STEP / 64)
+
+// Block structure for multi-threaded allocator (within regions). Same
+// single-word layout as Block: a region is one word of padding, then its
+// blocks back to back, then a fence word. Flag bits change without the
+// region lock (parking a block), so the word is only accessed atomically.
 typedef struct MTBlock
 {
-    size_t size;
-    struct MTBlock* next;
-    bool free;
+    size_t head;                   // tag | span | flags, 0 on the fence
 } MTBlock;
 
-// Memory region structure
-typedef struct MemRegion
+#define MT_BLOCK_MAGIC 0x3EB10CA1u  // seeds the address tag of Part B headers
+#define MT_BLOCK_CACHED ((size_t)4)  // Parked in a thread cache, see MTCache
+#define MT_BLOCK_ZEROED ((size_t)8)  // Free and, but for its tree node and footer, never written since sbrk
+#define MT_REGION_MAX_PAYLOAD (MT_REGION_SIZE - 3 * sizeof(MTBlock))
+
+// Memory region structure. Every region starts on its own cache line, so
+// threads working in different regions never share one; within a region
+// the fields written by other threads without the lock get a line of
+// their own as well.
+typedef struct __attribute__((aligned(MT_CACHE_LINE))) MemRegion
 {
+    pthread_mutex_t lock;          // Per-region mutex
+    FreeTree* free_tree;           // Free blocks by size (region lock)
     void* start;                   // Start of region memory
     size_t total_size;             // Total size of region
-    MTBlock* block_list;           // List of blocks in this region
-    pthread_mutex_t lock;          // Per-region mutex
     struct MemRegion* next;        // Link to next region (for dynamic regions)
+    struct MemRegion* arena_next;  // Link to next dynamic region of the same arena
+    int arena;                     // Arena that allocates from this region
+    size_t slab_size;              // Object size if this is a slab, 0 otherwise
+    size_t lock_contended;         // Lock acquisitions that had to wait (region lock)
+    void* remote_frees __attribute__((aligned(MT_CACHE_LINE))); // Lock-free stack of payloads freed by other arenas
+    uint64_t slab_used[MT_SLAB_MAP_WORDS]; // Slab occupancy, one bit per object
 } MemRegion;
 
+// Arena: the group of regions a thread allocates from. Initial region i
+// belongs to arena i % MT_ARENAS; regions created later belong to the arena
+// that needed them. Each thread is assigned a home arena on first use.
+typedef struct __attribute__((aligned(MT_CACHE_LINE))) MTArena
+{
+    pthread_mutex_t lock;          // Serialises adding regions to the arena
+    int index;                     // Arena number, first initial region
+    unsigned next_region;          // Round-robin cursor over initial regions (atomic)
+    MemRegion* extra_regions;      // Dynamic regions of this arena, lock-free reads
+    MemRegion* slabs[MT_SLAB_CLASSES];     // Slab regions per class, lock-free reads
+    MemRegion* slab_hint[MT_SLAB_CLASSES]; // Slab that last had room
+} MTArena;
+
+// Region map: a three level radix tree from address >> MT_REGION_SHIFT to
+// the MemRegion covering it (48-bit addresses). Only region creation and
+// mapped blocks write it, under the global lock; lookups are lock-free.
+// Page-aligned mapped payloads register their slot with a shared marker
+// region, as their header lies on the page before.
+#define MT_MAP_BITS 12
+#define MT_MAP_FANOUT (1 << MT_MAP_BITS)
+
+// Thread cache: freed blocks of up to MT_TCACHE_MAX_SIZE bytes are parked
+// per thread in exact-size classes (linked through their payload) and handed
+// out again without taking any lock. The blocks stay allocated as far as
+// their region is concerned.
+#define MT_TCACHE_MAX_SIZE 512
+#define MT_TCACHE_STEP ALIGNMENT
+#define MT_TCACHE_CLASSES (MT_TCACHE_MAX_SIZE / MT_TCACHE_STEP)
+#define MT_TCACHE_DEPTH 8          // Blocks kept per class
+
+typedef struct MTCache
+{
+    void* heads[MT_TCACHE_CLASSES];
+    unsigned char counts[MT_TCACHE_CLASSES];
+    unsigned generation;           // heapCreate generation the blocks belong to
+    bool registered;               // Exit destructor installed for this thread
+    bool dead;                     // Exit destructor ran, nothing is parked any more
+} MTCache;
+
+// Per-CPU cache mode: freed blocks are parked in a cache per CPU, picked
+// with sched_getcpu() and held under a short lock, instead of one per
+// thread, so parked memory grows with the core count rather than the
+// thread count. Off by default; switch it before threads start allocating.
+typedef struct __attribute__((aligned(MT_CACHE_LINE))) MTCPUCache
+{
+    pthread_mutex_t lock;
+    MTCache cache;
+} MTCPUCache;
+
+void heapSetPerCPUCache(bool enabled);
+
+// customAlignedAlloc for the Part B heap; the result is released with
+// customMTFree.
+void* customMTAlignedAlloc(size_t alignment, size_t size);
+
+// Usable bytes of a live Part B block (at least the size asked for), 0 for
+// NULL; like malloc_usable_size, ptr is not validated.
+size_t customMTUsableSize(void* ptr);
+
+// fork() handlers for the Part B heap, to be installed with pthread_atfork
+// by programs that fork while other threads allocate: the child then gets
+// the heap with no lock held by a thread that does not exist there. The
+// child does not write to an open allocation trace.
+void heapForkPrepare(void);
+void heapForkParent(void);
+void heapForkChild(void);
+
+/*=============================================================================
+* Statistics
+=============================================================================*/
+// Blocks are counted by usable size (the payload the block really has).
+// Size class 0 holds blocks of up to 16 bytes, class c > 0 those of
+// (8 << c, 16 << c] bytes, and the last class everything larger, so
+// allocs[c] - frees[c] is the number of live blocks of class c.
+#define STATS_SIZE_CLASSES 24
+
+typedef struct AllocStats
+{
+    size_t in_use_bytes;           // Usable bytes of live blocks, mapped ones included
+    size_t in_use_blocks;          // Live blocks
+    size_t heap_bytes;             // Bytes taken with sbrk (Part B: region memory)
+    size_t mapped_bytes;           // Bytes in private mappings
+    size_t mapped_blocks;          // Blocks with a mapping of their own
+    size_t free_bytes;             // Payload bytes of free heap/region blocks
+    size_t free_blocks;            // Free heap/region blocks (slab objects included)
+    size_t largest_free;           // Largest free heap/region block
+    size_t lock_contended;         // Part B: region lock acquisitions that had to wait
+    size_t allocs[STATS_SIZE_CLASSES];
+    size_t frees[STATS_SIZE_CLASSES];
+} AllocStats;
+
+// Snapshots. In Part B, blocks parked in a thread/CPU cache or on a
+// remote-free stack count as neither in use nor free.
+AllocStats customMallocStats(void);
+AllocStats customMTMallocStats(void);
+
+typedef struct MTRegionStats
+{
+    void* start;                   // Region memory
+    int arena;                     // Arena the region belongs to
+    size_t slab_size;              // Object size for slabs, 0 otherwise
+    size_t free_bytes;
+    size_t free_blocks;
+    size_t largest_free;
+    size_t lock_contended;         // Waits for the region lock
+} MTRegionStats;
+
+// Fills in up to `max` entries, one per region, and returns the number of
+// regions.
+size_t customMTRegionStats(MTRegionStats* out, size_t max);
+
+// Part B counters are kept per thread and only written by their thread,
+// with plain (relaxed atomic) stores, so counting costs no shared atomic
+// operation. Threads link their counters on first use; the counters of
+// exited threads are added to a global total.
+typedef struct MTThreadStats
+{
+    size_t allocs[STATS_SIZE_CLASSES];
+    size_t frees[STATS_SIZE_CLASSES];
+    size_t in_use_bytes;           // Net, wraps for threads freeing others' blocks
+    size_t mapped_bytes;
+    size_t mapped_blocks;
+    struct MTThreadStats* next;    // Linked threads (global lock)
+    bool registered;               // Linked and exit destructor installed
+    bool dead;                     // Exit destructor ran, counted as retired
+} MTThreadStats;
+
+/*=============================================================================
+* Sampling heap profiler (both allocators)
+=============================================================================*/
+// Once started, about one allocation per `sample_bytes` allocated bytes is
+// sampled (the distance to the next sample is drawn from an exponential
+// distribution, so every byte is equally likely to be picked) and its
+// backtrace kept until the block is freed. Costs one load per call while
+// stopped.
+void heapProfileStart(size_t sample_bytes);
+void heapProfileStop(void);
+
+// Writes the live samples to `path` in the legacy gperftools heap profile
+// format ("heap_v2"), followed by /proc/self/maps, so `pprof <binary>
+// <path>` can symbolise and unsample it. Returns 0, or -1 on I/O errors.
+int heapProfileDump(const char* path);
+
+#define PROF_MAX_DEPTH 32
+#define PROF_BUCKETS (1 << 16)     // Live sample chains, hashed by pointer
+
+typedef struct HeapSample
+{
+    void* ptr;                     // Sampled payload
+    size_t size;                   // Its usable size
+    int depth;
+    void* stack[PROF_MAX_DEPTH];
+    struct HeapSample* next;       // Bucket chain, or spare list
+} HeapSample;
+
+/*=============================================================================
+* Allocation trace (both allocators)
+=============================================================================*/
+// While a trace is open every customMalloc/Calloc/Realloc/Free/AlignedAlloc
+// call and its MT variant appends a TraceRecord to it; calls made inside
+// another call (realloc moving a block) are not recorded. Blocks allocated
+// before heapTraceStart are not traced. trace_replay replays the file.
+// Both return 0, or -1 on I/O errors.
+int heapTraceStart(const char* path);
+int heapTraceStop(void);
+
+#define TRACE_MAGIC 0x3145434152544143ull  // "CATRACE1", first 8 bytes of a trace
+#define TRACE_BUFFER 4096          // Records written out at a time
+#define TRACE_BUCKETS (1 << 16)    // Live traced pointer chains
+
+typedef enum TraceOp
+{
+    TRACE_MALLOC = 1,
+    TRACE_CALLOC,
+    TRACE_REALLOC,                 // Of an existing id; realloc(NULL) is a malloc
+    TRACE_FREE,                    // realloc(ptr, 0) included
+    TRACE_ALIGNED,
+    TRACE_MT = 0x80                // Flag: made through the Part B call
+} TraceOp;
+
+typedef struct TraceRecord
+{
+    uint64_t time_ns;              // Since heapTraceStart
+    uint64_t size;                 // Requested bytes, 0 for frees
+    uint32_t id;                   // Allocation id from 1, kept across reallocs
+    uint16_t thread;               // Calling thread, numbered from 1
+    uint8_t op;                    // TraceOp, possibly with TRACE_MT
+    uint8_t align_shift;           // log2 of the TRACE_ALIGNED alignment
+} TraceRecord;
+
+typedef struct TraceEntry
+{
+    void* ptr;                     // Live traced block
+    uint32_t id;
+    struct TraceEntry* next;       // Bucket chain, or spare list
+} TraceEntry;
+
 #endif // CUSTOM_ALLOCATOR
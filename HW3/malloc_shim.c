@@ -0,0 +1,114 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "customAllocator.h"
+
+/*=============================================================================
+* The Part B allocator as the process's malloc, built as
+* libcustomAllocator.so:
+*
+*   LD_PRELOAD=./libcustomAllocator.so ../HW2/bank ...
+*
+* The heap is created on the first call (or when the library is loaded,
+* whichever comes first) and the fork handlers are installed with it.
+* Alignments above the page size are not supported and fail with ENOMEM.
+=============================================================================*/
+
+static bool shim_ready = false;    // Heap created
+
+static void shim_init(void) {
+    if (__atomic_load_n(&shim_ready, __ATOMIC_ACQUIRE)) return;
+    heapCreate();
+    // pthread_atfork may allocate: mark the heap ready before calling it
+    if (!__atomic_exchange_n(&shim_ready, true, __ATOMIC_ACQ_REL)) {
+        pthread_atfork(heapForkPrepare, heapForkParent, heapForkChild);
+    }
+}
+
+__attribute__((constructor)) static void shim_load(void) {
+    shim_init();
+}
+
+static void* shim_result(void* ptr) {
+    if (ptr == NULL) errno = ENOMEM;
+    return ptr;
+}
+
+void* malloc(size_t size) {
+    shim_init();
+    // malloc(0) returns a unique pointer, as glibc's does
+    return shim_result(customMTMalloc(size ? size : 1));
+}
+
+void free(void* ptr) {
+    if (ptr == NULL) return;
+    customMTFree(ptr);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    shim_init();
+    if (size != 0 && nmemb > SIZE_MAX / size) return shim_result(NULL);
+    if (nmemb == 0 || size == 0) nmemb = size = 1;
+    return shim_result(customMTCalloc(nmemb, size));
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (ptr == NULL) return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    return shim_result(customMTRealloc(ptr, size));
+}
+
+void* reallocarray(void* ptr, size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) return shim_result(NULL);
+    return realloc(ptr, nmemb * size);
+}
+
+// Aligned allocation with glibc's rules: alignment is a power of two
+static void* shim_aligned(size_t alignment, size_t size) {
+    shim_init();
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return shim_result(customMTAlignedAlloc(alignment, size ? size : 1));
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+    int saved = errno;
+    void* ptr = shim_aligned(alignment, size);
+    int err = ptr ? 0 : errno;
+    errno = saved;
+    if (ptr) *memptr = ptr;
+    return err;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return shim_aligned(alignment, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    return shim_aligned(alignment, size);
+}
+
+void* valloc(size_t size) {
+    return shim_aligned((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page) return shim_result(NULL);
+    return shim_aligned(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void* ptr) {
+    return customMTUsableSize(ptr);
+}
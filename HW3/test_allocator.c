@@ -1,9 +1,18 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "customAllocator.h"
 
+// Explicit declaration for sbrk (needed for C99 standard)
+extern void *sbrk(intptr_t increment);
+
 /*=============================================================================
 * Part A Tests - Single Threaded Allocator
 =============================================================================*/
@@ -58,6 +67,41 @@ void test_part_a_calloc() {
     customFree(arr);
 }
 
+// Returns true when all `size` bytes at p are zero
+static bool all_zero(const char* p, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (p[i] != 0) return false;
+    }
+    return true;
+}
+
+void test_part_a_calloc_reuse() {
+    printf("=== Test Part A: Calloc Over Reused Memory ===\n");
+    
+    // Dirty some blocks so calloc has to clear them on reuse
+    char* blocks[8];
+    for (int i = 0; i < 8; i++) {
+        blocks[i] = (char*)customMalloc(300);
+        memset(blocks[i], 0xff, 300);
+    }
+    for (int i = 0; i < 8; i++) customFree(blocks[i]);
+    
+    bool pass = true;
+    for (int i = 0; i < 8; i++) {
+        blocks[i] = (char*)customCalloc(3, 100);
+        pass = pass && blocks[i] && all_zero(blocks[i], 300);
+    }
+    for (int i = 0; i < 8; i++) customFree(blocks[i]);
+    
+    // Huge tables are mapped and never touched by calloc
+    size_t size = 8 * 1024 * 1024;
+    char* table = (char*)customCalloc(size, 1);
+    pass = pass && table && all_zero(table, size);
+    customFree(table);
+    
+    printf("Calloc over reused memory: %s\n", pass ? "PASS" : "FAIL");
+}
+
 void test_part_a_realloc() {
     printf("=== Test Part A: Realloc ===\n");
     
@@ -131,6 +175,215 @@ void test_part_a_coalesce() {
     customFree(c);
 }
 
+void test_part_a_segregated_bins() {
+    printf("=== Test Part A: Best Fit Across Bins ===\n");
+    
+    // Free blocks of 600, 1000 and 700 bytes all go to the free tree,
+    // separated by in-use guards so they cannot coalesce
+    void* a = customMalloc(600);
+    void* g1 = customMalloc(16);
+    void* b = customMalloc(1000);
+    void* g2 = customMalloc(16);
+    void* c = customMalloc(700);
+    void* g3 = customMalloc(16);
+    void* small = customMalloc(40);
+    void* g4 = customMalloc(16);
+    
+    customFree(a);
+    customFree(b);
+    customFree(c);
+    customFree(small);
+    
+    // 690 bytes: the 700 byte block is the best fit inside the bin
+    void* d = customMalloc(690);
+    // 40 bytes: exact small bin hit
+    void* e = customMalloc(40);
+    
+    bool pass = (d == c) && (e == small);
+    printf("Best fit across bins: %s\n", pass ? "PASS" : "FAIL");
+    
+    customFree(d);
+    customFree(e);
+    customFree(g1);
+    customFree(g2);
+    customFree(g3);
+    customFree(g4);
+}
+
+void test_part_a_free_tree() {
+    printf("=== Test Part A: Free Tree Best Fit ===\n");
+    
+    // 64 free blocks of distinct large sizes, freed in scrambled order
+    enum { COUNT = 64 };
+    void* blocks[COUNT];
+    void* guards[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+        blocks[i] = customMalloc(520 + 32 * (size_t)i);
+        guards[i] = customMalloc(16);
+    }
+    for (int i = 0; i < COUNT; i++) {
+        customFree(blocks[(i * 37) % COUNT]);
+    }
+    
+    // Every request lands in the smallest block that holds it
+    bool pass = true;
+    for (int i = COUNT - 1; i >= 0; i -= 7) {
+        void* p = customMalloc(510 + 32 * (size_t)i);
+        if (p != blocks[i]) pass = false;
+        customFree(p);
+    }
+    printf("Free tree best fit: %s\n", pass ? "PASS" : "FAIL");
+    
+    for (int i = 0; i < COUNT; i++) {
+        customFree(guards[i]);
+    }
+}
+
+void test_part_a_stats() {
+    printf("=== Test Part A: Statistics ===\n");
+    
+    AllocStats before = customMallocStats();
+    void* a = customMalloc(100);
+    void* big = customMalloc(256 * 1024);
+    AllocStats during = customMallocStats();
+    
+    // 100 bytes get a 104 byte block, size class (64, 128]
+    bool pass = during.in_use_blocks == before.in_use_blocks + 2 &&
+                during.mapped_blocks == before.mapped_blocks + 1 &&
+                during.mapped_bytes >= before.mapped_bytes + 256 * 1024 &&
+                during.allocs[3] == before.allocs[3] + 1 &&
+                during.heap_bytes > 0;
+    
+    customFree(a);
+    customFree(big);
+    AllocStats after = customMallocStats();
+    pass = pass && after.in_use_blocks == before.in_use_blocks &&
+           after.in_use_bytes == before.in_use_bytes &&
+           after.mapped_bytes == before.mapped_bytes &&
+           after.frees[3] == before.frees[3] + 1 &&
+           after.free_blocks > 0 && after.largest_free >= 104;
+    printf("Heap statistics: %s\n", pass ? "PASS" : "FAIL");
+}
+
+void test_part_a_invalid_free() {
+    printf("=== Test Part A: Invalid Free ===\n");
+    
+    int local = 0;
+    char* a = (char*)customMalloc(64);
+    char* b = (char*)customMalloc(64);
+    
+    // Each of these should print a non-heap pointer error and change nothing
+    customFree(&local);
+    customFree(a + 8);
+    customFree(b);
+    customFree(b);  // double free
+    
+    // a must still be allocated, so the next block cannot land on it
+    void* c = customMalloc(64);
+    bool pass = (c != a);
+    printf("Invalid free rejected: %s\n", pass ? "PASS" : "FAIL");
+    
+    customFree(a);
+    customFree(c);
+}
+
+void test_part_a_trim_threshold() {
+    printf("=== Test Part A: Trim Threshold ===\n");
+    
+    // Start from a fully trimmed heap
+    heapSetTrimThreshold(0);
+    heapSetTrimThreshold(DEFAULT_TRIM_THRESHOLD);
+    void* before = sbrk(0);
+    
+    // A small free tail stays mapped below the default threshold
+    void* a = customMalloc(1000);
+    customFree(a);
+    bool kept = (sbrk(0) != before);
+    
+    // Dropping the threshold gives it back immediately
+    heapSetTrimThreshold(0);
+    bool released = (sbrk(0) == before);
+    
+    void* b = customMalloc(1000);
+    customFree(b);
+    released = released && (sbrk(0) == before);
+    heapSetTrimThreshold(DEFAULT_TRIM_THRESHOLD);
+    
+    printf("Trim threshold: %s\n", (kept && released) ? "PASS" : "FAIL");
+}
+
+void test_part_a_mmap_large() {
+    printf("=== Test Part A: Large Allocations Use mmap ===\n");
+    
+    void* before = sbrk(0);
+    size_t size = 4 * 1024 * 1024;
+    char* big = (char*)customMalloc(size);
+    if (big == NULL) {
+        printf("FAIL: large malloc returned NULL\n");
+        return;
+    }
+    memset(big, 0x5a, size);
+    
+    // The break must not move for a mapped block
+    bool pass = (sbrk(0) == before) && big[size - 1] == 0x5a;
+    
+    // Mapped blocks are resized by the kernel, both ways
+    big = (char*)customRealloc(big, 2 * size);
+    pass = pass && big != NULL && big[size - 1] == 0x5a;
+    if (pass) memset(big + size, 0x5a, size);
+    big = (char*)customRealloc(big, size / 2);
+    pass = pass && big != NULL && big[size / 2 - 1] == 0x5a;
+    customFree(big);
+    
+    printf("Large malloc via mmap: %s\n", pass ? "PASS" : "FAIL");
+}
+
+void test_part_a_realloc_in_place() {
+    printf("=== Test Part A: Realloc Grows In Place ===\n");
+    
+    char* a = (char*)customMalloc(100);
+    char* b = (char*)customMalloc(300);
+    char* guard = (char*)customMalloc(100);
+    memset(a, 7, 100);
+    customFree(b);
+    
+    // a absorbs the free block b left behind
+    char* grown = (char*)customRealloc(a, 350);
+    bool pass = (grown == a) && grown[99] == 7;
+    
+    customFree(grown);
+    customFree(guard);
+    printf("Realloc in place: %s\n", pass ? "PASS" : "FAIL");
+}
+
+void test_part_a_aligned() {
+    printf("=== Test Part A: Aligned Allocations ===\n");
+    
+    // Plain allocations are 16-byte aligned
+    char* p = (char*)customMalloc(7);
+    bool pass = (p != NULL) && ((uintptr_t)p % 16 == 0);
+    
+    char* a = (char*)customAlignedAlloc(64, 100);
+    char* b = (char*)customAlignedAlloc(4096, 200);
+    char* c = (char*)customAlignedAlloc(64, 1024 * 1024);
+    pass = pass && a && b && c;
+    pass = pass && ((uintptr_t)a % 64 == 0) && ((uintptr_t)b % 4096 == 0)
+                && ((uintptr_t)c % 64 == 0);
+    pass = pass && customAlignedAlloc(48, 100) == NULL;
+    if (pass) {
+        memset(a, 1, 100);
+        memset(b, 2, 200);
+        memset(c, 3, 1024 * 1024);
+        pass = a[99] == 1 && b[199] == 2 && c[1024 * 1024 - 1] == 3;
+    }
+    customFree(p);
+    customFree(a);
+    customFree(b);
+    customFree(c);
+    
+    printf("Aligned allocations: %s\n", pass ? "PASS" : "FAIL");
+}
+
 /*=============================================================================
 * Part B Tests - Multi-Threaded Allocator
 =============================================================================*/
@@ -183,6 +436,31 @@ void test_part_b_calloc() {
     customMTFree(arr);
 }
 
+void test_part_b_calloc_reuse() {
+    printf("=== Test Part B: MT Calloc Over Reused Memory ===\n");
+    
+    char* blocks[8];
+    for (int i = 0; i < 8; i++) {
+        blocks[i] = (char*)customMTMalloc(300);
+        memset(blocks[i], 0xff, 300);
+    }
+    for (int i = 0; i < 8; i++) customMTFree(blocks[i]);
+    
+    bool pass = true;
+    for (int i = 0; i < 8; i++) {
+        blocks[i] = (char*)customMTCalloc(3, 100);
+        pass = pass && blocks[i] && all_zero(blocks[i], 300);
+    }
+    for (int i = 0; i < 8; i++) customMTFree(blocks[i]);
+    
+    size_t size = 8 * 1024 * 1024;
+    char* table = (char*)customMTCalloc(size, 1);
+    pass = pass && table && all_zero(table, size);
+    customMTFree(table);
+    
+    printf("MT calloc over reused memory: %s\n", pass ? "PASS" : "FAIL");
+}
+
 void test_part_b_realloc() {
     printf("=== Test Part B: MT Realloc ===\n");
     
@@ -245,6 +523,554 @@ void test_part_b_multithreaded() {
     printf("Multi-threaded test: PASS (no crashes)\n");
 }
 
+void test_part_b_large() {
+    printf("=== Test Part B: Allocations Larger Than a Region ===\n");
+    
+    size_t size = 64 * 1024;
+    char* big = (char*)customMTMalloc(size);
+    if (big == NULL) {
+        printf("FAIL: large MTMalloc returned NULL\n");
+        return;
+    }
+    memset(big, 0x3c, size);
+    
+    bool pass = big[0] == 0x3c && big[size - 1] == 0x3c;
+    
+    big = (char*)customMTRealloc(big, 64 * size);
+    pass = pass && big != NULL && big[size - 1] == 0x3c;
+    if (pass) memset(big, 0x3c, 64 * size);
+    printf("Large MT malloc: %s\n", pass ? "PASS" : "FAIL");
+    customMTFree(big);
+}
+
+void test_part_b_thread_cache() {
+    printf("=== Test Part B: Thread Cache Reuse ===\n");
+    
+    // A freed block is handed straight back for the same size
+    void* a = customMTMalloc(200);
+    customMTFree(a);
+    void* b = customMTMalloc(200);
+    bool pass = (a == b);
+    
+    // Freeing it twice must still be caught
+    customMTFree(b);
+    customMTFree(b);
+    
+    printf("Thread cache reuse: %s\n", pass ? "PASS" : "FAIL");
+}
+
+void test_part_b_percpu_cache() {
+    printf("=== Test Part B: Per-CPU Cache ===\n");
+    
+    heapSetPerCPUCache(true);
+    
+    // The thread may migrate between free and malloc, so allow a few tries
+    bool pass = false;
+    for (int i = 0; i < 8 && !pass; i++) {
+        void* a = customMTMalloc(200);
+        customMTFree(a);
+        void* b = customMTMalloc(200);
+        pass = (a == b);
+        customMTFree(b);
+    }
+    
+    // Threads share the CPU caches
+    pthread_t threads[8];
+    int thread_ids[8];
+    for (int i = 0; i < 8; i++) {
+        thread_ids[i] = i;
+        pthread_create(&threads[i], NULL, thread_alloc_func, &thread_ids[i]);
+    }
+    for (int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    
+    heapSetPerCPUCache(false);
+    printf("Per-CPU cache reuse: %s\n", pass ? "PASS" : "FAIL");
+}
+
+void test_part_b_slab() {
+    printf("=== Test Part B: Headerless Slab Objects ===\n");
+    
+    // 24 byte objects share the 32 byte slab class back to back
+    char* a = (char*)customMTMalloc(24);
+    char* b = (char*)customMTMalloc(24);
+    bool pass = (a != NULL) && (b == a + 32);
+    
+    // A slab object is 16-byte aligned and cannot be freed twice
+    pass = pass && ((uintptr_t)a % 16 == 0);
+    customMTFree(a);
+    customMTFree(a);
+    customMTFree(b);
+    
+    // 48 byte objects: 85 fit a slab, the object-aligned offset after them
+    // is padding and can be neither freed nor handed out
+    char* c = (char*)customMTMalloc(40);
+    char* tail = (char*)((uintptr_t)c & ~(uintptr_t)(MT_REGION_SIZE - 1)) +
+                 (MT_REGION_SIZE / 48) * 48;
+    customMTFree(tail);
+    customMTRealloc(tail, 100);
+    char* d[MT_REGION_SIZE / 48];
+    for (int i = 0; i < MT_REGION_SIZE / 48; i++) {
+        d[i] = (char*)customMTMalloc(40);
+        pass = pass && d[i] != tail;
+    }
+    for (int i = 0; i < MT_REGION_SIZE / 48; i++) customMTFree(d[i]);
+    customMTFree(c);
+    
+    printf("Slab objects: %s\n", pass ? "PASS" : "FAIL");
+}
+
+void test_part_b_realloc_in_place() {
+    printf("=== Test Part B: MT Realloc Grows In Place ===\n");
+    
+    // Allocations rotate over the arena's regions, so keep allocating
+    // until one lands right after a
+    char* a = (char*)customMTMalloc(600);
+    char* others[8];
+    int n = 0, next = -1;
+    while (n < 8 && next < 0) {
+        others[n] = (char*)customMTMalloc(600);
+        if (others[n] == a + ALIGN_TO_MULT_OF_16(600 + sizeof(MTBlock))) next = n;
+        n++;
+    }
+    memset(a, 7, 600);
+    if (next >= 0) {
+        customMTFree(others[next]);
+        others[next] = NULL;
+    }
+    
+    char* grown = (char*)customMTRealloc(a, 1000);
+    bool pass = (next >= 0) && (grown == a) && grown[599] == 7;
+    
+    customMTFree(grown);
+    for (int i = 0; i < n; i++) {
+        if (others[i]) customMTFree(others[i]);
+    }
+    printf("MT realloc in place: %s\n", pass ? "PASS" : "FAIL");
+}
+
+void test_part_b_aligned() {
+    printf("=== Test Part B: Aligned MT Allocations ===\n");
+    
+    char* p = (char*)customMTMalloc(100);
+    char* a = (char*)customMTAlignedAlloc(64, 100);
+    char* b = (char*)customMTAlignedAlloc(4096, 200);
+    char* c = (char*)customMTAlignedAlloc(4096, 1024 * 1024);
+    bool pass = p && a && b && c && ((uintptr_t)p % 16 == 0);
+    pass = pass && ((uintptr_t)a % 64 == 0) && ((uintptr_t)b % 4096 == 0)
+                && ((uintptr_t)c % 4096 == 0);
+    if (pass) {
+        memset(a, 1, 100);
+        memset(b, 2, 200);
+        memset(c, 3, 1024 * 1024);
+        pass = a[99] == 1 && b[199] == 2 && c[1024 * 1024 - 1] == 3;
+    }
+    // A page-aligned mapping stays page aligned when it is resized
+    c = (char*)customMTRealloc(c, 8 * 1024 * 1024);
+    pass = pass && c && ((uintptr_t)c % 4096 == 0) && c[1024 * 1024 - 1] == 3;
+    customMTFree(p);
+    customMTFree(a);
+    customMTFree(b);
+    customMTFree(c);
+    
+    printf("Aligned MT allocations: %s\n", pass ? "PASS" : "FAIL");
+}
+
+#define STRESS_THREADS 8
+#define STRESS_ROUNDS 50000
+#define STRESS_LIVE 16
+
+// Stress thread: keeps a few region blocks alive, checking their contents
+// before each free
+void* thread_stress_func(void* arg) {
+    bool* ok = (bool*)arg;
+    char* live[STRESS_LIVE] = {0};
+    size_t sizes[STRESS_LIVE] = {0};
+    unsigned seed = (unsigned)(uintptr_t)arg;
+    for (int i = 0; i < STRESS_ROUNDS; i++) {
+        seed = seed * 1103515245u + 12345u;
+        int slot = (int)((seed >> 16) % STRESS_LIVE);
+        if (live[slot]) {
+            if (live[slot][0] != (char)slot || live[slot][sizes[slot] - 1] != (char)slot) {
+                *ok = false;
+            }
+            customMTFree(live[slot]);
+        }
+        sizes[slot] = 80 + (seed >> 8) % 700;
+        live[slot] = (char*)customMTMalloc(sizes[slot]);
+        if (!live[slot]) {
+            *ok = false;
+            break;
+        }
+        memset(live[slot], slot, sizes[slot]);
+    }
+    for (int slot = 0; slot < STRESS_LIVE; slot++) {
+        if (live[slot]) customMTFree(live[slot]);
+    }
+    return NULL;
+}
+
+void test_part_b_stress() {
+    printf("=== Test Part B: Multi-threaded Stress ===\n");
+    
+    pthread_t threads[STRESS_THREADS];
+    bool ok[STRESS_THREADS];
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        ok[i] = true;
+        pthread_create(&threads[i], NULL, thread_stress_func, &ok[i]);
+    }
+    bool pass = true;
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        pass = pass && ok[i];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ms = (double)(t1.tv_sec - t0.tv_sec) * 1e3 + (double)(t1.tv_nsec - t0.tv_nsec) / 1e6;
+    printf("%d threads x %d rounds: %.1f ms\n", STRESS_THREADS, STRESS_ROUNDS, ms);
+    printf("Multi-threaded stress: %s\n", pass ? "PASS" : "FAIL");
+}
+
+#define HANDOFF_BLOCKS 32
+
+// Producer thread: allocates blocks that the main thread frees
+void* thread_producer_func(void* arg) {
+    char** blocks = (char**)arg;
+    for (int i = 0; i < HANDOFF_BLOCKS; i++) {
+        blocks[i] = (char*)customMTMalloc(100);
+        if (blocks[i]) {
+            memset(blocks[i], i, 100);
+        }
+    }
+    return NULL;
+}
+
+// Above the thread cache limit, so frees go straight to the regions
+#define HANDOFF_SIZE 600
+
+typedef struct
+{
+    char* first[HANDOFF_BLOCKS];
+    char* second[HANDOFF_BLOCKS];
+    bool intact;                   // First round read back what was written
+    size_t regions_before;         // Region count before the second round
+    size_t regions_after;
+} Handoff;
+
+void* thread_consumer_func(void* arg) {
+    char** blocks = (char**)arg;
+    for (int i = 0; i < HANDOFF_BLOCKS; i++) {
+        customMTFree(blocks[i]);
+    }
+    return NULL;
+}
+
+// Allocates twice from the same thread (and so the same arena), with the
+// first round freed in between by a thread of another arena
+void* thread_handoff_func(void* arg) {
+    Handoff* h = (Handoff*)arg;
+    h->intact = true;
+    for (int i = 0; i < HANDOFF_BLOCKS; i++) {
+        h->first[i] = (char*)customMTMalloc(HANDOFF_SIZE);
+        if (h->first[i] == NULL) {
+            h->intact = false;
+            return NULL;
+        }
+        memset(h->first[i], i, HANDOFF_SIZE);
+    }
+    for (int i = 0; i < HANDOFF_BLOCKS; i++) {
+        if (h->first[i][0] != i || h->first[i][HANDOFF_SIZE - 1] != i) h->intact = false;
+    }
+    
+    // Arenas are handed out round-robin on first use, so the consumer,
+    // created after this thread allocated, has the next one
+    pthread_t consumer;
+    pthread_create(&consumer, NULL, thread_consumer_func, h->first);
+    pthread_join(consumer, NULL);
+    
+    h->regions_before = customMTRegionStats(NULL, 0);
+    for (int i = 0; i < HANDOFF_BLOCKS; i++) {
+        h->second[i] = (char*)customMTMalloc(HANDOFF_SIZE);
+    }
+    h->regions_after = customMTRegionStats(NULL, 0);
+    return NULL;
+}
+
+void test_part_b_cross_thread_free() {
+    printf("=== Test Part B: Cross-thread free ===\n");
+    
+    Handoff h;
+    pthread_t producer;
+    pthread_create(&producer, NULL, thread_handoff_func, &h);
+    pthread_join(producer, NULL);
+    
+    // The remote frees are drained back into the producer's regions: the
+    // second round needs no new region and stays in the first round's ones
+    bool pass = h.intact && h.regions_after == h.regions_before;
+    for (int i = 0; i < HANDOFF_BLOCKS && pass; i++) {
+        bool reused = false;
+        for (int j = 0; j < HANDOFF_BLOCKS && !reused; j++) {
+            reused = ((uintptr_t)h.second[i] >> MT_REGION_SHIFT) == ((uintptr_t)h.first[j] >> MT_REGION_SHIFT);
+        }
+        pass = reused;
+    }
+    for (int i = 0; i < HANDOFF_BLOCKS; i++) {
+        if (h.second[i]) customMTFree(h.second[i]);
+    }
+    
+    printf("Cross-thread free: %s\n", pass ? "PASS" : "FAIL");
+}
+
+void test_part_b_stats() {
+    printf("=== Test Part B: Statistics ===\n");
+    
+    AllocStats before = customMTMallocStats();
+    char* blocks[HANDOFF_BLOCKS];
+    pthread_t producer;
+    pthread_create(&producer, NULL, thread_producer_func, blocks);
+    pthread_join(producer, NULL);
+    void* slab = customMTMalloc(40);
+    void* big = customMTMalloc(256 * 1024);
+    AllocStats during = customMTMallocStats();
+    
+    // The producer's 100 byte blocks (104 usable) count in class (64, 128]
+    // even though the thread is gone
+    bool pass = during.in_use_blocks == before.in_use_blocks + HANDOFF_BLOCKS + 2 &&
+                during.allocs[3] >= before.allocs[3] + HANDOFF_BLOCKS &&
+                during.mapped_blocks == before.mapped_blocks + 1 &&
+                during.heap_bytes >= MT_INITIAL_REGIONS * MT_REGION_SIZE;
+    
+    for (int i = 0; i < HANDOFF_BLOCKS; i++) {
+        customMTFree(blocks[i]);
+    }
+    customMTFree(slab);
+    customMTFree(big);
+    AllocStats after = customMTMallocStats();
+    pass = pass && after.in_use_blocks == before.in_use_blocks &&
+           after.in_use_bytes == before.in_use_bytes &&
+           after.mapped_bytes == before.mapped_bytes;
+    
+    MTRegionStats regions[4];
+    size_t count = customMTRegionStats(regions, 4);
+    pass = pass && count >= MT_INITIAL_REGIONS && regions[0].start != NULL;
+    printf("MT statistics: %s\n", pass ? "PASS" : "FAIL");
+}
+
+// A block freed by a thread-specific data destructor that puts itself off
+// to the last destructor round, so the free comes after the allocator's own
+// destructors and nothing it sets up is destroyed any more, as with glibc's
+// thread cleanup under the malloc shim
+typedef struct
+{
+    void* block;
+    int rounds;                    // Destructor rounds seen
+    size_t region_free;            // Free bytes of the block's region once allocated
+} LateFree;
+
+static pthread_key_t late_free_key;
+static pthread_once_t late_free_once = PTHREAD_ONCE_INIT;
+
+static void late_free_destructor(void* arg) {
+    LateFree* lf = (LateFree*)arg;
+    if (++lf->rounds < PTHREAD_DESTRUCTOR_ITERATIONS) {
+        pthread_setspecific(late_free_key, lf);
+        return;
+    }
+    customMTFree(lf->block);
+}
+
+static void late_free_make_key(void) {
+    pthread_key_create(&late_free_key, late_free_destructor);
+}
+
+void* thread_late_free_func(void* arg) {
+    // allocate and free first, so the allocator's destructors are installed
+    customMTFree(customMTMalloc(100));
+    pthread_once(&late_free_once, late_free_make_key);
+    pthread_setspecific(late_free_key, arg);
+    return NULL;
+}
+
+void* thread_idle_func(void* arg) {
+    return arg;
+}
+
+void test_part_b_late_free_stats() {
+    printf("=== Test Part B: Free after thread exit destructors ===\n");
+    
+    AllocStats before = customMTMallocStats();
+    LateFree lf = { customMTMalloc(1000), 0, 0 };
+    pthread_t t;
+    pthread_create(&t, NULL, thread_late_free_func, &lf);
+    pthread_join(t, NULL);
+    // the next thread gets the exited one's cached stack, and with it
+    // freshly zeroed thread-local storage
+    pthread_create(&t, NULL, thread_idle_func, NULL);
+    pthread_join(t, NULL);
+    
+    // The late free is counted with the exited threads, and the counters of
+    // the threads still running are all still linked
+    AllocStats after = customMTMallocStats();
+    bool pass = lf.rounds == PTHREAD_DESTRUCTOR_ITERATIONS && after.in_use_blocks == before.in_use_blocks &&
+                after.in_use_bytes == before.in_use_bytes &&
+                after.allocs[6] == before.allocs[6] + 1 && after.frees[6] == before.frees[6] + 1;
+    printf("Late free counted: %s\n", pass ? "PASS" : "FAIL");
+}
+
+// Free bytes of the Part B region holding ptr
+static size_t region_free_bytes(void* ptr) {
+    static MTRegionStats regions[1024];
+    size_t count = customMTRegionStats(regions, 1024);
+    for (size_t i = 0; i < count && i < 1024; i++) {
+        if (((uintptr_t)regions[i].start >> MT_REGION_SHIFT) == ((uintptr_t)ptr >> MT_REGION_SHIFT)) {
+            return regions[i].free_bytes;
+        }
+    }
+    return 0;
+}
+
+void* thread_late_own_free_func(void* arg) {
+    LateFree* lf = (LateFree*)arg;
+    // the first free installs the cache's destructor, the block is then
+    // handed out again from the cache
+    customMTFree(customMTMalloc(100));
+    lf->block = customMTMalloc(100);
+    lf->region_free = region_free_bytes(lf->block);
+    pthread_once(&late_free_once, late_free_make_key);
+    pthread_setspecific(late_free_key, lf);
+    return NULL;
+}
+
+void test_part_b_late_free_cache() {
+    printf("=== Test Part B: Thread cache after thread exit destructors ===\n");
+    
+    // The thread frees its own 100 byte block after its cache was flushed:
+    // the block goes back to its region instead of being parked for good
+    LateFree lf = { NULL, 0, 0 };
+    pthread_t t;
+    pthread_create(&t, NULL, thread_late_own_free_func, &lf);
+    pthread_join(t, NULL);
+    
+    bool pass = lf.rounds == PTHREAD_DESTRUCTOR_ITERATIONS &&
+                region_free_bytes(lf.block) >= lf.region_free + 100;
+    printf("Late free not cached: %s\n", pass ? "PASS" : "FAIL");
+}
+
+// Counts the sample lines of a heapProfileDump file, -1 if it is malformed
+static int count_profile_samples(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return -1;
+    char line[1024];
+    int samples = -1;
+    if (fgets(line, sizeof(line), f) && strncmp(line, "heap profile: ", 14) == 0) {
+        samples = 0;
+        while (fgets(line, sizeof(line), f) && line[0] != '\n') {
+            if (strstr(line, "] @ 0x") != NULL) samples++;
+        }
+    }
+    fclose(f);
+    return samples;
+}
+
+void test_part_b_profile() {
+    printf("=== Test Part B: Heap profiler ===\n");
+    
+    const char* path = "/tmp/customAllocator_test.heap";
+    heapProfileStart(1);
+    // the first allocation only seeds this thread's sampler
+    void* seed = customMalloc(16);
+    char* a = (char*)customMalloc(300);
+    char* b = (char*)customMTMalloc(300);
+    bool pass = heapProfileDump(path) == 0 && count_profile_samples(path) == 2;
+    customFree(a);
+    customMTFree(b);
+    pass = pass && heapProfileDump(path) == 0 && count_profile_samples(path) == 0;
+    
+    // Stopped: nothing is sampled
+    heapProfileStop();
+    a = (char*)customMTMalloc(300);
+    pass = pass && heapProfileDump(path) == 0 && count_profile_samples(path) == 0;
+    customMTFree(a);
+    customFree(seed);
+    remove(path);
+    printf("Sampled live allocations: %s\n", pass ? "PASS" : "FAIL");
+}
+
+void test_part_b_trace() {
+    printf("=== Test Part B: Allocation trace ===\n");
+    
+    const char* path = "/tmp/customAllocator_test.trace";
+    void* before = customMTMalloc(100);    // not traced
+    bool pass = heapTraceStart(path) == 0;
+    char* a = (char*)customMalloc(100);
+    a = (char*)customRealloc(a, 5000);     // moves, without recording its inner calls
+    char* b = (char*)customMTCalloc(10, 30);
+    customFree(a);
+    customMTFree(b);
+    customMTFree(before);
+    pass = heapTraceStop() == 0 && pass;
+    
+    TraceRecord r[8];
+    uint64_t magic = 0;
+    size_t n = 0;
+    FILE* f = fopen(path, "rb");
+    if (f != NULL) {
+        if (fread(&magic, sizeof(magic), 1, f) == 1) n = fread(r, sizeof(TraceRecord), 8, f);
+        fclose(f);
+    }
+    remove(path);
+    pass = pass && magic == TRACE_MAGIC && n == 5 &&
+           r[0].op == TRACE_MALLOC && r[0].size == 100 &&
+           r[1].op == TRACE_REALLOC && r[1].id == r[0].id && r[1].size == 5000 &&
+           r[2].op == (TRACE_CALLOC | TRACE_MT) && r[2].size == 300 && r[2].id != r[0].id &&
+           r[3].op == TRACE_FREE && r[3].id == r[0].id &&
+           r[4].op == (TRACE_FREE | TRACE_MT) && r[4].id == r[2].id &&
+           r[0].thread != 0 && r[4].thread == r[0].thread && r[4].time_ns >= r[0].time_ns;
+    printf("Recorded calls: %s\n", pass ? "PASS" : "FAIL");
+}
+
+static void* thread_churn_func(void* arg) {
+    volatile bool* done = (volatile bool*)arg;
+    while (!__atomic_load_n(done, __ATOMIC_RELAXED)) {
+        customMTFree(customMTMalloc(200));
+    }
+    return NULL;
+}
+
+void test_part_b_fork() {
+    printf("=== Test Part B: fork and usable size ===\n");
+    
+    char* a = (char*)customMTMalloc(100);
+    char* big = (char*)customMTMalloc(300 * 1024);
+    bool pass = customMTUsableSize(a) >= 100 && customMTUsableSize(big) >= 300 * 1024 &&
+                customMTUsableSize(NULL) == 0;
+    
+    // Fork while another thread allocates; the child must find no lock held
+    pthread_atfork(heapForkPrepare, heapForkParent, heapForkChild);
+    bool done = false;
+    pthread_t churn;
+    pthread_create(&churn, NULL, thread_churn_func, &done);
+    for (int i = 0; i < 20 && pass; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            void* blocks[64];
+            for (int j = 0; j < 64; j++) blocks[j] = customMTMalloc(32 + 64 * j);
+            for (int j = 0; j < 64; j++) customMTFree(blocks[j]);
+            customMTFree(a);
+            _exit(0);
+        }
+        int status = -1;
+        pass = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    __atomic_store_n(&done, true, __ATOMIC_RELAXED);
+    pthread_join(churn, NULL);
+    customMTFree(a);
+    customMTFree(big);
+    printf("fork while allocating: %s\n", pass ? "PASS" : "FAIL");
+}
+
 void test_part_b_round_robin() {
     printf("=== Test Part B: Round-robin allocation ===\n");
     
@@ -269,7 +1095,15 @@ void test_part_b_round_robin() {
         }
     }
     
-    printf("Round-robin allocations: %s\n", all_different ? "PASS" : "FAIL");
+    // Two region allocations in a row come from different regions
+    char* r1 = (char*)customMTMalloc(456);
+    char* r2 = (char*)customMTMalloc(456);
+    bool spread = r1 && r2 &&
+                  ((uintptr_t)r1 >> MT_REGION_SHIFT) != ((uintptr_t)r2 >> MT_REGION_SHIFT);
+    customMTFree(r1);
+    customMTFree(r2);
+    
+    printf("Round-robin allocations: %s\n", all_different && spread ? "PASS" : "FAIL");
     
     // Free all
     for (int i = 0; i < 8; i++) {
@@ -284,9 +1118,18 @@ int main() {
     
     test_part_a_basic_malloc();
     test_part_a_calloc();
+    test_part_a_calloc_reuse();
     test_part_a_realloc();
     test_part_a_best_fit();
     test_part_a_coalesce();
+    test_part_a_segregated_bins();
+    test_part_a_free_tree();
+    test_part_a_invalid_free();
+    test_part_a_stats();
+    test_part_a_trim_threshold();
+    test_part_a_mmap_large();
+    test_part_a_realloc_in_place();
+    test_part_a_aligned();
     
     printf("\n========================================\n");
     printf("       PART B TESTS (Multi-Thread)      \n");
@@ -296,9 +1139,24 @@ int main() {
     
     test_part_b_basic_malloc();
     test_part_b_calloc();
+    test_part_b_calloc_reuse();
     test_part_b_realloc();
     test_part_b_round_robin();
+    test_part_b_large();
+    test_part_b_thread_cache();
+    test_part_b_percpu_cache();
+    test_part_b_slab();
+    test_part_b_realloc_in_place();
+    test_part_b_aligned();
     test_part_b_multithreaded();
+    test_part_b_cross_thread_free();
+    test_part_b_stats();
+    test_part_b_late_free_stats();
+    test_part_b_late_free_cache();
+    test_part_b_profile();
+    test_part_b_trace();
+    test_part_b_fork();
+    test_part_b_stress();
     
     heapKill();
     
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include "customAllocator.h"
+
+/*=============================================================================
+* Replays a heapTraceStart trace against one of the allocators:
+*
+*   trace_replay [-a mt|single|glibc] [-s] <trace>
+*
+* -a picks the allocator (default mt), -s replays every thread's calls on
+* one thread in trace order (always the case for the single-threaded Part A
+* allocator). Otherwise each traced thread gets a replay thread, and a call
+* on an id waits for the call before it on that id, wherever that ran.
+=============================================================================*/
+
+typedef enum { ALLOC_MT, ALLOC_SINGLE, ALLOC_GLIBC } Allocator;
+
+static Allocator allocator = ALLOC_MT;
+static TraceRecord* records;
+static size_t num_records;
+static uint32_t* turn;             // Per record: calls on its id before it
+static uint32_t* done;             // Per id: calls on it replayed so far
+static void** blocks;              // Per id: its live block
+static size_t* sizes;              // Per id: its requested size
+static size_t live_bytes = 0;
+static size_t peak_live = 0;
+static size_t failures = 0;
+
+typedef struct
+{
+    uint16_t thread;               // Traced thread to replay, 0 for all
+    pthread_t handle;
+} Worker;
+
+static void* do_alloc(const TraceRecord* r) {
+    size_t alignment = (size_t)1 << r->align_shift;
+    switch (allocator) {
+    case ALLOC_MT:
+        if ((r->op & ~TRACE_MT) == TRACE_CALLOC) return customMTCalloc(1, r->size);
+        if ((r->op & ~TRACE_MT) == TRACE_ALIGNED) return customMTAlignedAlloc(alignment, r->size);
+        return customMTMalloc(r->size);
+    case ALLOC_SINGLE:
+        if ((r->op & ~TRACE_MT) == TRACE_CALLOC) return customCalloc(1, r->size);
+        if ((r->op & ~TRACE_MT) == TRACE_ALIGNED) return customAlignedAlloc(alignment, r->size);
+        return customMalloc(r->size);
+    default:
+        if ((r->op & ~TRACE_MT) == TRACE_CALLOC) return calloc(1, r->size);
+        if ((r->op & ~TRACE_MT) == TRACE_ALIGNED) {
+            void* ptr = NULL;
+            if (alignment < sizeof(void*)) alignment = sizeof(void*);
+            return posix_memalign(&ptr, alignment, r->size) == 0 ? ptr : NULL;
+        }
+        return malloc(r->size);
+    }
+}
+static void* do_realloc(void* ptr, size_t size) {
+    switch (allocator) {
+    case ALLOC_MT: return customMTRealloc(ptr, size);
+    case ALLOC_SINGLE: return customRealloc(ptr, size);
+    default: return realloc(ptr, size);
+    }
+}
+static void do_free(void* ptr) {
+    switch (allocator) {
+    case ALLOC_MT: customMTFree(ptr); break;
+    case ALLOC_SINGLE: customFree(ptr); break;
+    default: free(ptr); break;
+    }
+}
+
+// Writes one byte per page, the way a program would start using the block
+static void touch(char* ptr, size_t size) {
+    for (size_t off = 0; off < size; off += 4096) ptr[off] = 1;
+}
+static void account(size_t add, size_t sub) {
+    size_t live = __atomic_add_fetch(&live_bytes, add - sub, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_live, __ATOMIC_RELAXED);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&peak_live, &peak, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void replay(size_t i) {
+    const TraceRecord* r = &records[i];
+    uint32_t id = r->id;
+    while (__atomic_load_n(&done[id], __ATOMIC_ACQUIRE) != turn[i]) sched_yield();
+    switch (r->op & ~TRACE_MT) {
+    case TRACE_FREE:
+        if (blocks[id]) {
+            do_free(blocks[id]);
+            account(0, sizes[id]);
+            blocks[id] = NULL;
+        }
+        break;
+    case TRACE_REALLOC:
+        if (blocks[id]) {
+            void* ptr = do_realloc(blocks[id], r->size);
+            if (ptr) {
+                if (r->size > sizes[id]) touch((char*)ptr + sizes[id], r->size - sizes[id]);
+                account(r->size, sizes[id]);
+                blocks[id] = ptr;
+                sizes[id] = r->size;
+            } else {
+                __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+            }
+        }
+        break;
+    default:
+        blocks[id] = do_alloc(r);
+        if (blocks[id]) {
+            touch((char*)blocks[id], r->size);
+            account(r->size, 0);
+            sizes[id] = r->size;
+        } else {
+            __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+        }
+        break;
+    }
+    __atomic_store_n(&done[id], turn[i] + 1, __ATOMIC_RELEASE);
+}
+static void* worker_func(void* arg) {
+    Worker* w = (Worker*)arg;
+    for (size_t i = 0; i < num_records; i++) {
+        if (w->thread == 0 || records[i].thread == w->thread) replay(i);
+    }
+    return NULL;
+}
+
+static bool load_trace(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    uint64_t magic = 0;
+    bool ok = fread(&magic, sizeof(magic), 1, f) == 1 && magic == TRACE_MAGIC;
+    size_t cap = 0;
+    while (ok) {
+        if (num_records == cap) {
+            cap = cap ? cap * 2 : 4096;
+            TraceRecord* grown = (TraceRecord*)realloc(records, cap * sizeof(TraceRecord));
+            if (grown == NULL) {
+                ok = false;
+                break;
+            }
+            records = grown;
+        }
+        size_t want = cap - num_records;
+        size_t n = fread(records + num_records, sizeof(TraceRecord), want, f);
+        num_records += n;
+        if (n < want) break;
+    }
+    fclose(f);
+    if (!ok) fprintf(stderr, "%s: not a trace\n", path);
+    return ok;
+}
+
+static long max_rss_kb(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    bool serial = false, usage = argc < 2;
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            if (strcmp(name, "mt") == 0) allocator = ALLOC_MT;
+            else if (strcmp(name, "single") == 0) allocator = ALLOC_SINGLE;
+            else if (strcmp(name, "glibc") == 0) allocator = ALLOC_GLIBC;
+            else usage = true;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            serial = true;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (usage || path == NULL) {
+        fprintf(stderr, "usage: %s [-a mt|single|glibc] [-s] <trace>\n", argv[0]);
+        return 2;
+    }
+    if (!load_trace(path)) return 1;
+
+    // Number every call on an id, and size the per id and thread tables
+    uint32_t max_id = 0;
+    uint16_t max_thread = 0;
+    for (size_t i = 0; i < num_records; i++) {
+        if (records[i].id > max_id) max_id = records[i].id;
+        if (records[i].thread > max_thread) max_thread = records[i].thread;
+    }
+    turn = (uint32_t*)malloc((num_records + 1) * sizeof(uint32_t));
+    done = (uint32_t*)calloc((size_t)max_id + 1, sizeof(uint32_t));
+    blocks = (void**)calloc((size_t)max_id + 1, sizeof(void*));
+    sizes = (size_t*)calloc((size_t)max_id + 1, sizeof(size_t));
+    if (!turn || !done || !blocks || !sizes) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < num_records; i++) turn[i] = done[records[i].id]++;
+    // clearing also faults the tables in before the RSS baseline
+    memset(done, 0, ((size_t)max_id + 1) * sizeof(uint32_t));
+    memset(blocks, 0, ((size_t)max_id + 1) * sizeof(void*));
+    memset(sizes, 0, ((size_t)max_id + 1) * sizeof(size_t));
+
+    if (allocator == ALLOC_SINGLE) serial = true;
+    if (allocator == ALLOC_MT) heapCreate();
+    size_t num_workers = serial || max_thread == 0 ? 1 : max_thread;
+    Worker* workers = (Worker*)calloc(num_workers, sizeof(Worker));
+    if (!workers) return 1;
+    long base_rss = max_rss_kb();
+
+    double start = now_sec();
+    if (num_workers == 1) {
+        worker_func(&workers[0]);
+    } else {
+        for (size_t t = 0; t < num_workers; t++) {
+            workers[t].thread = (uint16_t)(t + 1);
+            pthread_create(&workers[t].handle, NULL, worker_func, &workers[t]);
+        }
+        for (size_t t = 0; t < num_workers; t++) pthread_join(workers[t].handle, NULL);
+    }
+    double elapsed = now_sec() - start;
+    long peak_rss = max_rss_kb();
+
+    // Memory the allocator took beyond the bytes the program asked for, at
+    // the program's peak
+    long grown_kb = peak_rss - base_rss;
+    double frag = grown_kb > 0 ? 1.0 - (double)peak_live / 1024.0 / (double)grown_kb : 0.0;
+    static const char* names[] = { "mt", "single", "glibc" };
+    printf("trace:          %s (%zu calls, %u ids, %u threads)\n", path, num_records, max_id, max_thread);
+    printf("allocator:      %s, %zu replay thread%s\n", names[allocator], num_workers, num_workers == 1 ? "" : "s");
+    printf("time:           %.3f s, %.0f calls/s\n", elapsed, elapsed > 0 ? (double)num_records / elapsed : 0.0);
+    printf("peak live:      %zu KiB\n", peak_live / 1024);
+    printf("peak RSS:       %ld KiB (+%ld KiB during the replay)\n", peak_rss, grown_kb);
+    printf("fragmentation:  %.1f%%\n", frag > 0 ? frag * 100.0 : 0.0);
+    if (failures) printf("failed calls:   %zu\n", failures);
+
+    if (allocator == ALLOC_MT) heapKill();
+    return 0;
+}